@@ -0,0 +1,29 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+/* Object archives: the .ob, .ent and .ext files of one run, written by main --archive=FILE
+   into one file and read back by obextract. A reader finds a member by a binary search of
+   the index and reads it alone, without scanning the archive. */
+
+#define ARCHIVE_MAGIC      "AOBA"
+#define ARCHIVE_VERSION    1
+#define ARCHIVE_BYTE_ORDER 0x01020304U     /* an archive is only read on a host of its byte order */
+
+/* An archive file is a header, the index, the member names and the member contents. Every
+   reference is an offset from the start of the file. */
+typedef struct {
+    char magic[4];
+    unsigned int version;
+    unsigned int byte_order;
+    unsigned int size;          /* of the whole file */
+    unsigned int member_count;
+    unsigned int index;         /* member_count ArchiveMember, sorted by name (strcmp order) */
+} ArchiveHeader;
+
+typedef struct {
+    unsigned int name;          /* NUL-terminated: the path the file would have been written to */
+    unsigned int offset;        /* of the contents */
+    unsigned int size;
+} ArchiveMember;
+
+#endif
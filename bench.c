@@ -0,0 +1,392 @@
+/* Microbenchmarks of the assembler's inner kernels, each timed in isolation over randomized
+   but repeatable inputs (a fixed seed). Every kernel is warmed up, then run --repeat times
+   for --iterations calls; the fastest run is reported, with the median as a noise check.
+   --save=FILE keeps the results as a baseline, --compare=FILE shows the speedup against one. */
+
+#define ASSEMBLER_NO_MAIN
+#include "main.c"
+
+#define BENCH_INPUTS 1024           /* a power of two: call i uses input i & (BENCH_INPUTS-1) */
+#define BENCH_SYMBOLS 256           /* labels defined in the symbol table */
+#define MAX_REPEAT 101
+#define MAX_BASELINE 64
+#define BENCH_NAME_LENGTH 32
+
+typedef struct {
+    const char *name;
+    long (*run)(long iterations);   /* returns a checksum, so the calls cannot be optimized out */
+} Kernel;
+
+typedef struct {
+    char name[BENCH_NAME_LENGTH];
+    double ns;                      /* per call, -1 if unknown */
+    double cycles;
+} BenchResult;
+
+/* inputs, generated once by make_inputs */
+char bench_operands[BENCH_INPUTS][MAX_LINE_LENGTH];
+char bench_mnemonics[BENCH_INPUTS][MAX_LINE_LENGTH];
+char bench_labels[BENCH_INPUTS][MAX_LINE_LENGTH];      /* three in four are defined */
+char bench_lines[BENCH_INPUTS][MAX_LINE_LENGTH];       /* normalized instruction lines */
+char bench_raw_lines[BENCH_INPUTS][MAX_LINE_LENGTH];   /* the same with stray spaces and tabs */
+int bench_words[BENCH_INPUTS];
+char bench_symbols[BENCH_SYMBOLS][MAX_LINE_LENGTH];
+
+unsigned long bench_seed = 1;
+long bench_iterations = 1000000;
+long bench_warmup = 100000;
+int bench_repeat = 5;
+const char *bench_filter = NULL;
+const char *bench_save = NULL;
+const char *bench_compare = NULL;
+volatile long bench_sink;           /* where the checksums go */
+
+/* Small LCG, so that inputs are the same on every libc */
+unsigned long bench_random(unsigned long bound) {
+    bench_seed = (bench_seed * 1103515245UL + 12345UL) & 0x7FFFFFFFUL;
+    return (bench_seed >> 8) % bound;
+}
+
+/* A random operand as it would appear in a source: #n, rN, LABEL or LABEL[rN] */
+void random_operand(char *out, bool allow_immediate) {
+    const char *label = bench_symbols[bench_random(BENCH_SYMBOLS)];
+    int reg = (int)bench_random(REGISTER_COUNT);
+
+    switch (bench_random(allow_immediate ? 4 : 3)) {
+    case 0:  sprintf(out, "r%d", reg); break;
+    case 1:  sprintf(out, "%s", label); break;
+    case 2:  sprintf(out, "%s[r%d]", label, reg); break;
+    default: sprintf(out, "#%d", (int)bench_random(WORD_MASK + 1) - (WORD_SIGN)); break;
+    }
+}
+
+/* Inserts spaces and tabs where a hand-written source might have them */
+void scatter_spaces(const char *line, char *out) {
+    static const char *fillers[] = {"", " ", "  ", "\t", " \t "};
+    int w = 0;
+
+    w += sprintf(out, "%s", fillers[bench_random(5)]);
+    for (; *line && w < MAX_LINE_LENGTH - 8; line++) {
+        if (*line == ' ' || *line == ',') {
+            w += sprintf(out + w, "%s%c%s", fillers[bench_random(5)], *line, fillers[bench_random(5)]);
+        } else {
+            out[w++] = *line;
+        }
+    }
+    sprintf(out + w, "%s\n", fillers[bench_random(5)]);
+}
+
+/* Fills the input tables and defines the benchmark labels in the symbol table */
+void make_inputs(void) {
+    char ops[2][MAX_LINE_LENGTH];
+    const OpcodeInfo *info;
+    Symbol *sym;
+    int i, w;
+
+    reset_assembler_state();
+    for (i = 0; i < BENCH_SYMBOLS; i++) {
+        sprintf(bench_symbols[i], "%c%s%d", "LMKS"[bench_random(4)],
+                bench_random(2) ? "OOP" : "ABEL", (int)bench_random(1000));
+        sym = calloc(1, sizeof(Symbol));
+        if (!sym) exit(1);
+        sym->name = intern_name(bench_symbols[i]);
+        sym->address = 100 + i;
+        sym->next = symbol_table_head;
+        symbol_table_head = sym;
+    }
+
+    for (i = 0; i < BENCH_INPUTS; i++) {
+        random_operand(bench_operands[i], true);
+
+        /* one mnemonic in eight is misspelled, as in a line that is not an instruction */
+        info = &opcode_table[bench_random(OPCODE_COUNT)];
+        sprintf(bench_mnemonics[i], "%s%s", info->name, bench_random(8) ? "" : "x");
+
+        if (bench_random(4)) {
+            strcpy(bench_labels[i], bench_symbols[bench_random(BENCH_SYMBOLS)]);
+        } else {
+            sprintf(bench_labels[i], "UNDEF%d", (int)bench_random(1000));
+        }
+
+        w = 0;
+        if (!bench_random(4)) w += sprintf(bench_lines[i], "%s: ", bench_symbols[bench_random(BENCH_SYMBOLS)]);
+        w += sprintf(bench_lines[i] + w, "%s", info->name);
+        if (info->num_operands == 2) {
+            random_operand(ops[0], true);
+            random_operand(ops[1], info->dst_mask & MODE_IMM);
+            sprintf(bench_lines[i] + w, " %s,%s", ops[0], ops[1]);
+        } else if (info->num_operands == 1) {
+            random_operand(ops[0], info->dst_mask & MODE_IMM);
+            sprintf(bench_lines[i] + w, " %s", ops[0]);
+        }
+        scatter_spaces(bench_lines[i], bench_raw_lines[i]);
+
+        bench_words[i] = (int)bench_random(WORD_MASK + 1);
+    }
+}
+
+/* ---- kernels ---- */
+
+long bench_detect_addressing_mode(long iterations) {
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        sum += detect_addressing_mode(bench_operands[i & (BENCH_INPUTS - 1)]);
+    }
+    return sum;
+}
+
+long bench_find_opcode(long iterations) {
+    const OpcodeInfo *info;
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        info = find_opcode(bench_mnemonics[i & (BENCH_INPUTS - 1)]);
+        sum += info ? info->code : -1;
+    }
+    return sum;
+}
+
+long bench_find_symbol(long iterations) {
+    Symbol *sym;
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        sym = find_symbol(bench_labels[i & (BENCH_INPUTS - 1)]);
+        sum += sym ? sym->address : -1;
+    }
+    return sum;
+}
+
+long bench_encode_instruction(long iterations) {
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        sum += encode_instruction(bench_lines[i & (BENCH_INPUTS - 1)]);
+    }
+    return sum;
+}
+
+long bench_word_to_base4(long iterations) {
+    char out[WORD_DIGITS + 1];
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        word_to_base4(bench_words[i & (BENCH_INPUTS - 1)], out);
+        sum += out[0] + out[WORD_DIGITS - 1];
+    }
+    return sum;
+}
+
+long bench_collapse_spaces(long iterations) {
+    char out[MAX_LINE_LENGTH];
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        collapse_spaces(bench_raw_lines[i & (BENCH_INPUTS - 1)], out);
+        sum += out[0];
+    }
+    return sum;
+}
+
+long bench_strip_comma_spaces(long iterations) {
+    char out[MAX_LINE_LENGTH];
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        strip_comma_spaces(bench_raw_lines[i & (BENCH_INPUTS - 1)], out);
+        sum += out[0];
+    }
+    return sum;
+}
+
+long bench_normalize_line(long iterations) {
+    char out[MAX_LINE_LENGTH + 1];
+    long i, sum = 0;
+    for (i = 0; i < iterations; i++) {
+        normalize_line(bench_raw_lines[i & (BENCH_INPUTS - 1)], out);
+        sum += out[0];
+    }
+    return sum;
+}
+
+static const Kernel kernels[] = {
+    {"detect_addressing_mode", bench_detect_addressing_mode},
+    {"find_opcode",            bench_find_opcode},
+    {"find_symbol",            bench_find_symbol},
+    {"encode_instruction",     bench_encode_instruction},
+    {"word_to_base4",          bench_word_to_base4},
+    {"collapse_spaces",        bench_collapse_spaces},
+    {"strip_comma_spaces",     bench_strip_comma_spaces},
+    {"normalize_line",         bench_normalize_line}
+};
+static const int KERNEL_COUNT = sizeof(kernels)/sizeof(kernels[0]);
+
+/* ---- timing ---- */
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The time-stamp counter where there is one, otherwise -1 (cycles are then not reported) */
+double now_cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return hi * 4294967296.0 + lo;
+#else
+    return -1;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Runs one kernel: warm-up, then bench_repeat timed runs. Fills in the fastest run per
+   call and returns the median per call */
+double run_kernel(const Kernel *kernel, BenchResult *result) {
+    double ns[MAX_REPEAT], cycles[MAX_REPEAT];
+    double start_ns, start_cycles;
+    int r, best = 0;
+
+    bench_sink = kernel->run(bench_warmup);
+    for (r = 0; r < bench_repeat; r++) {
+        start_cycles = now_cycles();
+        start_ns = now_ns();
+        bench_sink = kernel->run(bench_iterations);
+        ns[r] = (now_ns() - start_ns) / bench_iterations;
+        cycles[r] = start_cycles < 0 ? -1 : (now_cycles() - start_cycles) / bench_iterations;
+        if (ns[r] < ns[best]) best = r;
+    }
+    strncpy(result->name, kernel->name, BENCH_NAME_LENGTH - 1);
+    result->name[BENCH_NAME_LENGTH - 1] = '\0';
+    result->ns = ns[best];
+    result->cycles = cycles[best];
+
+    qsort(ns, bench_repeat, sizeof(double), compare_doubles);
+    return ns[bench_repeat / 2];
+}
+
+/* ---- baselines ---- */
+
+/* Reads a file written by save_baseline; returns the number of results, -1 if unreadable */
+int load_baseline(const char *filename, BenchResult baseline[]) {
+    FILE *fp = fopen(filename, "r");
+    char line[MAX_LINE_LENGTH];
+    int count = 0;
+
+    if (!fp) return -1;
+    while (count < MAX_BASELINE && fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%31s %lf %lf", baseline[count].name, &baseline[count].ns, &baseline[count].cycles) == 3) {
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+bool save_baseline(const char *filename, const BenchResult results[], int count) {
+    FILE *fp = fopen(filename, "w");
+    int i;
+
+    if (!fp) return false;
+    fprintf(fp, "# kernel ns/op cycles/op (isa %s, %ld iterations)\n", ISA_NAME, bench_iterations);
+    for (i = 0; i < count; i++) {
+        fprintf(fp, "%s %.4f %.4f\n", results[i].name, results[i].ns, results[i].cycles);
+    }
+    return fclose(fp) == 0;
+}
+
+const BenchResult *find_baseline(const BenchResult baseline[], int count, const char *name) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (strcmp(baseline[i].name, name) == 0) return &baseline[i];
+    }
+    return NULL;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [--iterations=N] [--warmup=N] [--repeat=N] [--seed=N] [--filter=TEXT]\n"
+            "       [--save=FILE] [--compare=FILE]\n"
+            "  --filter=TEXT   only the kernels whose name contains TEXT\n"
+            "  --save=FILE     write the results as a baseline\n"
+            "  --compare=FILE  show the speedup against a saved baseline\n", program);
+}
+
+bool parse_bench_options(int argc, char *argv[]) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--iterations=", 13) == 0 && atol(arg + 13) > 0) {
+            bench_iterations = atol(arg + 13);
+        } else if (strncmp(arg, "--warmup=", 9) == 0 && isdigit((unsigned char)arg[9])) {
+            bench_warmup = atol(arg + 9);
+        } else if (strncmp(arg, "--repeat=", 9) == 0 && atoi(arg + 9) > 0 && atoi(arg + 9) <= MAX_REPEAT) {
+            bench_repeat = atoi(arg + 9);
+        } else if (strncmp(arg, "--seed=", 7) == 0 && isdigit((unsigned char)arg[7])) {
+            bench_seed = strtoul(arg + 7, NULL, 10);
+        } else if (strncmp(arg, "--filter=", 9) == 0) {
+            bench_filter = arg + 9;
+        } else if (strncmp(arg, "--save=", 7) == 0 && arg[7]) {
+            bench_save = arg + 7;
+        } else if (strncmp(arg, "--compare=", 10) == 0 && arg[10]) {
+            bench_compare = arg + 10;
+        } else {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    BenchResult results[MAX_BASELINE], baseline[MAX_BASELINE];
+    const BenchResult *base;
+    int i, count = 0, baseline_count = 0;
+    unsigned long seed;
+    double median;
+
+    if (!parse_bench_options(argc, argv)) {
+        return 1;
+    }
+    if (bench_compare) {
+        baseline_count = load_baseline(bench_compare, baseline);
+        if (baseline_count < 0) {
+            fprintf(stderr, "Error: cannot read baseline %s\n", bench_compare);
+            return 1;
+        }
+    }
+    seed = bench_seed;
+    make_inputs();
+
+    printf("isa %s, %ld iterations x %d runs after %ld warm-up, seed %lu\n",
+           ISA_NAME, bench_iterations, bench_repeat, bench_warmup, seed);
+    printf("%-24s %10s %10s %10s", "kernel", "ns/op", "median", "cycles/op");
+    if (bench_compare) printf(" %10s %8s", "base ns", "speedup");
+    printf("\n");
+
+    for (i = 0; i < KERNEL_COUNT; i++) {
+        if (bench_filter && !strstr(kernels[i].name, bench_filter)) continue;
+        median = run_kernel(&kernels[i], &results[count]);
+        printf("%-24s %10.2f %10.2f ", results[count].name, results[count].ns, median);
+        if (results[count].cycles >= 0) printf("%10.1f", results[count].cycles);
+        else printf("%10s", "-");
+        if (bench_compare) {
+            base = find_baseline(baseline, baseline_count, results[count].name);
+            if (base && results[count].ns > 0) {
+                printf(" %10.2f %7.2fx", base->ns, base->ns / results[count].ns);
+            } else {
+                printf(" %10s %8s", "-", "-");
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+        count++;
+    }
+
+    if (bench_save && !save_baseline(bench_save, results, count)) {
+        fprintf(stderr, "Error: cannot write baseline %s\n", bench_save);
+        return 1;
+    }
+    reset_assembler_state();
+    return 0;
+}
@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* Compiles an instruction set description (a file under isa/) into isa_tables.h: the opcode table,
+   the word layout as constants and an encoder specialized for that layout, so the assembler
+   never reads the description at run time.
+   Usage: isa_gen DESCRIPTION OUTPUT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_LINE_LENGTH 256
+#define MAX_OPCODES 64
+#define MAX_WORD_BITS 15            /* a memory word is a short */
+
+#define bool int
+#define true 1
+#define false 0
+
+/* One field of the first word of an instruction */
+typedef struct {
+    const char *name;
+    int shift;
+    int width;                      /* 0 until the description sets it */
+} Field;
+
+typedef struct {
+    char name[16];
+    int code;
+    int operands;
+    char src[8];                    /* mode letters, "-" for none */
+    char dst[8];
+} Opcode;
+
+/* Addressing modes: their letter in op lines and the name of their constant */
+static const char mode_letters[] = "IDXR";
+static const char *mode_names[] = {"immediate", "direct", "index", "register"};
+static const char *mode_macros[] = {"IMMEDIATE", "DIRECT", "INDEX", "REGISTER"};
+static const char *mask_macros[] = {"MODE_IMM", "MODE_DIR", "MODE_IDX", "MODE_REG"};
+
+char isa_name[64];
+int word_bits = 0, register_bits = 0, register_count = 0;
+int mode_numbers[4] = {-1, -1, -1, -1};
+Field fields[3] = {{"opcode", 0, 0}, {"src", 0, 0}, {"dst", 0, 0}};
+Opcode opcodes[MAX_OPCODES];
+int opcode_count = 0;
+
+const char *description;
+int line_number = 0;
+
+void fail(const char *message, const char *detail) {
+    if (line_number > 0) fprintf(stderr, "%s:%d: ", description, line_number);
+    else fprintf(stderr, "%s: ", description);
+    fprintf(stderr, message, detail);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* Mask of the addressing modes named by letters like "IDXR" */
+int mode_mask(const char *letters, int *mask) {
+    const char *p;
+    *mask = 0;
+    if (strcmp(letters, "-") == 0) return true;
+    for (p = letters; *p; p++) {
+        const char *at = strchr(mode_letters, *p);
+        if (!at) return false;
+        *mask |= 1 << (at - mode_letters);
+    }
+    return true;
+}
+
+void parse_line(char *line) {
+    char keyword[32], name[32], src[16], dst[16];
+    int a, b, i, mask;
+    char *hash = strchr(line, '#');
+
+    if (hash) *hash = '\0';
+    if (sscanf(line, "%31s", keyword) != 1) return;
+
+    if (strcmp(keyword, "name") == 0) {
+        if (sscanf(line, "%*s %63s", isa_name) != 1) fail("expected name NAME", NULL);
+    } else if (strcmp(keyword, "word") == 0) {
+        if (sscanf(line, "%*s %d", &word_bits) != 1 || word_bits < 4 || word_bits > MAX_WORD_BITS)
+            fail("expected word BITS, at most 15", NULL);
+    } else if (strcmp(keyword, "field") == 0) {
+        if (sscanf(line, "%*s %31s %d %d", name, &a, &b) != 3 || a < 0 || b < 1) fail("expected field NAME SHIFT WIDTH", NULL);
+        for (i = 0; i < 3 && strcmp(fields[i].name, name) != 0; i++)
+            ;
+        if (i == 3) fail("unknown field '%s'", name);
+        fields[i].shift = a;
+        fields[i].width = b;
+    } else if (strcmp(keyword, "register_bits") == 0) {
+        if (sscanf(line, "%*s %d", &register_bits) != 1 || register_bits < 1) fail("expected register_bits BITS", NULL);
+    } else if (strcmp(keyword, "registers") == 0) {
+        if (sscanf(line, "%*s %d", &register_count) != 1 || register_count < 1) fail("expected registers COUNT", NULL);
+    } else if (strcmp(keyword, "mode") == 0) {
+        if (sscanf(line, "%*s %31s %d", name, &a) != 2 || a < 0) fail("expected mode NAME NUMBER", NULL);
+        for (i = 0; i < 4 && strcmp(mode_names[i], name) != 0; i++)
+            ;
+        if (i == 4) fail("unknown addressing mode '%s'", name);
+        mode_numbers[i] = a;
+    } else if (strcmp(keyword, "op") == 0) {
+        Opcode *op = &opcodes[opcode_count];
+        if (opcode_count == MAX_OPCODES) fail("too many opcodes", NULL);
+        if (sscanf(line, "%*s %15s %d %d %7s %7s", op->name, &a, &b, src, dst) != 5)
+            fail("expected op NAME CODE OPERANDS SOURCE-MODES DESTINATION-MODES", NULL);
+        if (b < 0 || b > 2) fail("'%s' must take 0, 1 or 2 operands", op->name);
+        if (!mode_mask(src, &mask) || !mode_mask(dst, &mask)) fail("bad addressing modes for '%s'", op->name);
+        if ((b < 2) != (strcmp(src, "-") == 0) || (b < 1) != (strcmp(dst, "-") == 0))
+            fail("the modes of '%s' do not match its operand count", op->name);
+        for (i = 0; i < opcode_count; i++) {
+            if (strcmp(opcodes[i].name, op->name) == 0) fail("opcode '%s' defined twice", op->name);
+        }
+        op->code = a;
+        op->operands = b;
+        strcpy(op->src, src);
+        strcpy(op->dst, dst);
+        opcode_count++;
+    } else {
+        fail("unknown keyword '%s'", keyword);
+    }
+}
+
+/* Checks that the description is complete and that its layout fits in a word */
+void check_description(void) {
+    int i, j, max_mode = 0;
+
+    line_number = 0;
+    if (!isa_name[0]) fail("missing name", NULL);
+    if (!word_bits) fail("missing word", NULL);
+    if (!register_bits || !register_count) fail("missing register_bits or registers", NULL);
+    if (register_count > (1 << register_bits) || 2 * register_bits > word_bits)
+        fail("two register numbers must fit in one word", NULL);
+    for (i = 0; i < 4; i++) {
+        if (mode_numbers[i] < 0) fail("missing mode %s", mode_names[i]);
+        for (j = 0; j < i; j++) {
+            if (mode_numbers[i] == mode_numbers[j]) fail("two addressing modes have the same number", NULL);
+        }
+        if (mode_numbers[i] > max_mode) max_mode = mode_numbers[i];
+    }
+    for (i = 0; i < 3; i++) {
+        if (!fields[i].width) fail("missing field %s", fields[i].name);
+        if (fields[i].shift + fields[i].width > word_bits) fail("field %s does not fit in a word", fields[i].name);
+        for (j = 0; j < i; j++) {
+            if (fields[i].shift < fields[j].shift + fields[j].width &&
+                fields[j].shift < fields[i].shift + fields[i].width) {
+                fail("field %s overlaps another field", fields[i].name);
+            }
+        }
+    }
+    if (max_mode >= (1 << fields[1].width) || max_mode >= (1 << fields[2].width))
+        fail("addressing mode numbers do not fit the src and dst fields", NULL);
+
+    /* the table is indexed by code, so the codes must be 0, 1, ... in order */
+    for (i = 0; i < opcode_count; i++) {
+        if (opcodes[i].code != i) fail("opcode '%s' is out of order: codes must be 0, 1, 2, ...", opcodes[i].name);
+    }
+    if (opcode_count == 0 || opcode_count > (1 << fields[0].width))
+        fail("the opcodes do not fit the opcode field", NULL);
+}
+
+void write_mask(FILE *out, const char *letters) {
+    const char *p;
+    if (strcmp(letters, "-") == 0) {
+        fprintf(out, "0");
+        return;
+    }
+    for (p = letters; *p; p++) {
+        fprintf(out, "%s%s", p == letters ? "" : "|", mask_macros[strchr(mode_letters, *p) - mode_letters]);
+    }
+}
+
+void write_tables(FILE *out) {
+    int i;
+    char upper[16];
+    size_t k;
+
+    fprintf(out, "/* Generated by isa_gen from %s; edit the description, not this file */\n\n", description);
+    fprintf(out, "#ifndef ISA_TABLES_H\n#define ISA_TABLES_H\n\n");
+    fprintf(out, "#define ISA_NAME \"%s\"\n\n", isa_name);
+
+    fprintf(out, "/* memory words, written as WORD_DIGITS base-4 digits */\n");
+    fprintf(out, "#define WORD_BITS   %d\n", word_bits);
+    fprintf(out, "#define WORD_MASK   0x%X\n", (1 << word_bits) - 1);
+    fprintf(out, "#define WORD_SIGN   0x%X\n", 1 << (word_bits - 1));
+    fprintf(out, "#define WORD_DIGITS %d\n\n", (word_bits + 1) / 2);
+
+    fprintf(out, "/* fields of the first word of an instruction */\n");
+    fprintf(out, "#define OPCODE_SHIFT   %d\n#define OPCODE_MASK    0x%X\n", fields[0].shift, (1 << fields[0].width) - 1);
+    fprintf(out, "#define SRC_MODE_SHIFT %d\n#define SRC_MODE_MASK  0x%X\n", fields[1].shift, (1 << fields[1].width) - 1);
+    fprintf(out, "#define DST_MODE_SHIFT %d\n#define DST_MODE_MASK  0x%X\n\n", fields[2].shift, (1 << fields[2].width) - 1);
+
+    fprintf(out, "/* a register operand word holds the source register above the destination one */\n");
+    fprintf(out, "#define REGISTER_BITS  %d\n#define REGISTER_MASK  0x%X\n", register_bits, (1 << register_bits) - 1);
+    fprintf(out, "#define REGISTER_COUNT %d\n\n", register_count);
+
+    fprintf(out, "/* addressing modes, as numbered in the src and dst fields, and their bit-masks */\n");
+    for (i = 0; i < 4; i++) {
+        fprintf(out, "#define ADDR_%-9s %d\n", mode_macros[i], mode_numbers[i]);
+    }
+    for (i = 0; i < 4; i++) {
+        fprintf(out, "#define %s (1<<ADDR_%s)\n", mask_macros[i], mode_macros[i]);
+    }
+
+    fprintf(out, "\n/* opcodes */\n");
+    for (i = 0; i < opcode_count; i++) {
+        for (k = 0; opcodes[i].name[k] && k < sizeof(upper) - 1; k++) upper[k] = (char)toupper((unsigned char)opcodes[i].name[k]);
+        upper[k] = '\0';
+        fprintf(out, "#define OP_%-5s %d\n", upper, opcodes[i].code);
+    }
+
+    fprintf(out, "\n/* static table of all %d opcodes, indexed by code */\n", opcode_count);
+    fprintf(out, "static const OpcodeInfo opcode_table[] = {\n");
+    for (i = 0; i < opcode_count; i++) {
+        fprintf(out, "    {\"%s\", %d, %d, ", opcodes[i].name, opcodes[i].code, opcodes[i].operands);
+        write_mask(out, opcodes[i].src);
+        fprintf(out, ", ");
+        write_mask(out, opcodes[i].dst);
+        fprintf(out, "}%s\n", i + 1 < opcode_count ? "," : "");
+    }
+    fprintf(out, "};\nstatic const int OPCODE_COUNT = sizeof(opcode_table)/sizeof(opcode_table[0]);\n\n");
+
+    fprintf(out, "/* The primary word of an instruction, with the layout of this description folded in */\n");
+    fprintf(out, "static int isa_encode(int opcode, int src_mode, int dst_mode) {\n");
+    fprintf(out, "    return (opcode & 0x%X) << %d | (src_mode & 0x%X) << %d | (dst_mode & 0x%X) << %d;\n",
+            (1 << fields[0].width) - 1, fields[0].shift, (1 << fields[1].width) - 1, fields[1].shift,
+            (1 << fields[2].width) - 1, fields[2].shift);
+    fprintf(out, "}\n\n#endif\n");
+}
+
+int main(int argc, char *argv[]) {
+    char line[MAX_LINE_LENGTH];
+    FILE *in, *out;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s DESCRIPTION OUTPUT\n", argv[0]);
+        return 1;
+    }
+    description = argv[1];
+    in = fopen(description, "r");
+    if (!in) fail("cannot open the description", NULL);
+    while (fgets(line, sizeof(line), in)) {
+        line_number++;
+        parse_line(line);
+    }
+    fclose(in);
+    check_description();
+
+    out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "cannot create %s\n", argv[2]);
+        return 1;
+    }
+    write_tables(out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "cannot write %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
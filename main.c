@@ -1,7 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "archive.h"
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 /* Maximum length for a line in the source file, including null terminator */
 #define MAX_LINE_LENGTH 81
@@ -11,12 +31,6 @@
 #define true 1
 #define false 0
 
-/* bit-masks for addressing modes */
-#define MODE_IMM (1<<0)
-#define MODE_DIR (1<<1)
-#define MODE_IDX (1<<2)
-#define MODE_REG (1<<3)
-
 /* Information for each opcode */
 typedef struct {
     const char *name;
@@ -26,20 +40,22 @@ typedef struct {
     int dst_mask;   /* which modes allowed for dst */
 } OpcodeInfo;
 
-/* Represents a line in memory (instruction or data) */
-typedef struct {
-    int address;        /* Memory address */
-    int value;          /* Binary value */
-    int is_code;        /* 1 = instruction, 0 = data */
-} MemoryWord;
+/* One word of the memory image: WORD_BITS bits are used, data values keep their sign */
+typedef short Word;
+
+/* Index of an interned string (see intern_name), 0 is no name */
+typedef unsigned int NameId;
+#define NO_NAME 0
 
 /* Struct for symbol table entry */
 typedef struct Symbol {
-    char name[MAX_LINE_LENGTH];
+    NameId name;
     int address;
     bool is_data;
     bool is_external;
     bool is_entry;
+    bool is_bss;        /* in the zero-fill segment: address is an offset in it until
+                           generate_extra_operand_words places the segment */
     struct Symbol *next;
 } Symbol;
 
@@ -52,37 +68,60 @@ typedef struct DataNode {
 
 /* Struct for code instructions */
 typedef struct InstructionNode {
-    int address;
-    char line[MAX_LINE_LENGTH];
+    int address;        /* first pass address, final address once operand words are added */
+    int line_number;    /* line in the .am file */
+    int length;         /* words, once operand words are added */
+    const char *line;   /* interned, see intern_line */
     struct InstructionNode *next;
 } InstructionNode;
 
+/* Segments a label can be in; the linker moves each one by its own amount */
+enum { SEGMENT_CODE, SEGMENT_DATA, SEGMENT_BSS, SEGMENT_COUNT };
+
+/* Struct for a word that holds the address of a local label, or an expression using labels */
+typedef struct Fixup {
+    int address;        /* address of the operand word */
+    struct Symbol *symbol;
+    const char *expr;   /* interned expression the word holds instead (symbol is then NULL) */
+    int line_number;    /* .am line of an expression, for its errors */
+    int moves[SEGMENT_COUNT];   /* how the value of expr follows the segments, see Term */
+    bool linear;        /* false if it cannot follow them (a label multiplied or divided) */
+    struct Fixup *next;
+} Fixup;
+
+/* Struct for a use of an external label in an operand word */
+typedef struct ExternalUse {
+    NameId name;
+    int address;        /* address of the operand word to patch */
+    struct ExternalUse *next;
+} ExternalUse;
+
+/* Most formal parameters a macro can have */
+#define MAX_MACRO_PARAMS 8
+
+/* One piece of a compiled macro body: literal text of the body, or a parameter slot */
+typedef struct MacroSpan {
+    int start;          /* offset of the literal text in content */
+    int length;
+    int param;          /* index of the parameter, -1 for literal text */
+} MacroSpan;
+
 typedef struct Macro {
-    char name[MAX_LINE_LENGTH];
-    char content[MAX_LINE_LENGTH * 10];
+    const char *name;       /* stored after the struct, or in a macro library */
+    const char *content;
+    int param_count;
+    const MacroSpan *spans; /* content compiled by compile_macro */
+    int span_count;
+    bool shared;            /* spans belong to the include cache or a macro library */
     struct Macro *next;
 } Macro;
 
-/* static table of all 16 opcodes */
-static const OpcodeInfo opcode_table[] = {
-    {"mov", 0, 2, MODE_IMM|MODE_DIR|MODE_IDX|MODE_REG, MODE_DIR|MODE_IDX|MODE_REG},
-    {"cmp", 1, 2, MODE_IMM|MODE_DIR|MODE_IDX|MODE_REG, MODE_IMM|MODE_DIR|MODE_IDX|MODE_REG},
-    {"add", 2, 2, MODE_IMM|MODE_DIR|MODE_IDX|MODE_REG, MODE_DIR|MODE_IDX|MODE_REG},
-    {"sub", 3, 2, MODE_IMM|MODE_DIR|MODE_IDX|MODE_REG, MODE_DIR|MODE_IDX|MODE_REG},
-    {"not", 4, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"clr", 5, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"lea", 6, 2, MODE_DIR|MODE_IDX,       MODE_DIR|MODE_IDX|MODE_REG},
-    {"inc", 7, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"dec", 8, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"jmp", 9, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"bne",10, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"jsr",11, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"red",12, 1, 0,                        MODE_DIR|MODE_IDX|MODE_REG},
-    {"prn",13, 1, MODE_IMM|MODE_DIR|MODE_IDX|MODE_REG, 0},
-    {"rts",14, 0, 0,                        0},
-    {"stop",15,0, 0,                        0}
-};
-static const int OPCODE_COUNT = sizeof(opcode_table)/sizeof(opcode_table[0]);
+/* The instruction set: opcode table, word layout, addressing mode numbers and isa_encode,
+   generated by isa_gen from isa/<ISA>.isa */
+#include "isa_tables.h"
+
+/* register and index operands both name a register */
+#define HOLDS_REGISTER(mode) ((mode) == ADDR_INDEX || (mode) == ADDR_REGISTER)
 
 /* Lookup an OpcodeInfo by name, or return NULL */
 const OpcodeInfo* find_opcode(const char *name) {
@@ -98,10 +137,19 @@ const OpcodeInfo* find_opcode(const char *name) {
 /* Macro table */
 Macro *macro_table = NULL;
 
-/* Memory table (array of memory words) */
+/* Size of an error message buffer */
+#define ERROR_LENGTH 256
+
+/* Memory image, indexed by address. During the first pass code and data words are mixed
+   in source order; once operand words are generated the image is two dense segments,
+   code at [100, data_start) and data at [data_start, memory_counter). The zero-fill
+   segment of .space/.zero and uninitialized .mat follows at [memory_counter,
+   memory_counter + bss_size): only its size is kept, the loader clears it. */
 #define MAX_MEMORY 1024
-MemoryWord memory[MAX_MEMORY];
+Word memory[MAX_MEMORY];
 int memory_counter = 100;  /* Starts at 100 as per project specs */
+int data_start = 100;      /* first data address of the final image */
+int bss_size = 0;          /* words in the zero-fill segment */
 
 
 /* Symbol table */
@@ -111,1217 +159,5447 @@ Symbol *symbol_table_head = NULL;
 InstructionNode *instruction_head = NULL;
 InstructionNode *instruction_tail = NULL;
 
+/* External label uses, in address order */
+ExternalUse *external_use_head = NULL;
+ExternalUse *external_use_tail = NULL;
+
+/* Operand words holding local label addresses, rewritten when labels move */
+Fixup *fixup_head = NULL;
+
+/* Command line options (see parse_options) */
+bool opt_optimize = false;      /* -O: run the peephole pass before operand words are generated */
+bool opt_pool_data = false;     /* --pool-data: share identical .data/.string/.mat blocks */
+bool opt_report_packing = false; /* --report-packing: print words saved by register packing */
+int packed_words = 0;            /* operand words saved by register packing in the last image */
+bool opt_disasm = false;        /* --disasm: arguments are .ob files to disassemble */
+bool opt_roundtrip = false;     /* --roundtrip: disassemble and reassemble each output, compare */
+const char *opt_link_output = NULL;   /* --link=OUT: arguments are .ob files linked into OUT */
+const char *opt_build_macro_lib = NULL;   /* --build-macro-lib=OUT: save the macros of the arguments in OUT */
+const char *opt_macro_lib = NULL;     /* --macro-lib=FILE: map a macro library for every source */
+bool opt_server = false;        /* --server[=SOCKET]: assemble sources sent on stdin or a socket */
+const char *opt_socket = NULL;
+const char *opt_output = NULL;  /* --output=BASE: name of the outputs of a source read from stdin */
+bool opt_watch = false;         /* --watch: reassemble the sources whenever they change */
+enum { DUMP_NONE, DUMP_TEXT, DUMP_CSV, DUMP_JSON };
+int opt_dump = DUMP_NONE;       /* --dump[=text|csv|json]: print memory and symbol table after each file */
+int opt_jobs = 1;               /* --jobs=N: worker threads (default: one per CPU) */
+bool opt_parallel_pass = false; /* --jobs=N given: large sources get the parallel first pass */
+#define MAX_LINK_JOBS 64
+int opt_max_errors = 0;         /* --max-errors=N: stop a file after N errors (0: no limit) */
+bool opt_fail_fast = false;     /* --fail-fast: no operand words or output files once a file has errors */
+bool opt_diag_json = false;     /* --diagnostics=json: report a file's diagnostics as one JSON line */
+enum { BATCH_NONE, BATCH_RING, BATCH_SYNC };
+int opt_batch_io = BATCH_NONE;  /* --batch-io[=sync]: read sources ahead and write outputs behind */
+const char *opt_archive = NULL; /* --archive=FILE: the outputs of every source go into FILE */
+
+/* Diagnostics of the file being assembled, in the order they were reported */
+typedef struct Diagnostic {
+    int line;                   /* source line, 0 when the error is not tied to a line */
+    int column;                 /* 1-based, 0 when unknown */
+    const char *code;           /* short stable name, e.g. "unknown-opcode" */
+    char message[ERROR_LENGTH];
+    struct Diagnostic *next;
+} Diagnostic;
+
+Diagnostic *diagnostic_head = NULL;
+Diagnostic *diagnostic_tail = NULL;
+const char *diagnostic_file = "";   /* source the diagnostics belong to */
+int error_count = 0;                /* errors in the current file */
+int total_errors = 0;               /* errors in every file of this run */
+bool diagnostics_muted = false;     /* probe runs (watch mode) report nothing */
+
+/* Source line of each line of an intermediate file. Macro definitions, macro uses and
+   .include make the lines of the .pre and .am files drift from those of the source. */
+typedef struct {
+    int *lines;                 /* lines[i] is the source line of line i + 1 */
+    int count;
+    int capacity;
+} LineMap;
+
+LineMap pre_source_lines = { NULL, 0, 0 };
+LineMap am_source_lines  = { NULL, 0, 0 };
+const LineMap *diagnostic_lines = NULL;     /* set while the passes report .am lines */
+
 /* Implementation */
-Symbol *find_symbol(const char *name) {
-    Symbol *cur = symbol_table_head;
-    while (cur) {
-        if (strcmp(cur->name, name) == 0) {
-            return cur;
-        }
-        cur = cur->next;
+/* Drops the diagnostics of the previous file and starts collecting them for src */
+void begin_diagnostics(const char *src) {
+    Diagnostic *next;
+    while (diagnostic_head) {
+        next = diagnostic_head->next;
+        free(diagnostic_head);
+        diagnostic_head = next;
     }
-    return NULL;
+    diagnostic_tail = NULL;
+    diagnostic_file = src;
+    diagnostic_lines = NULL;
+    error_count = 0;
 }
 
-/* Validate operand count and addressing modes for one instruction */
-bool validate_instruction(const char *line, int line_num, const char *file_name) {
-    char buf[MAX_LINE_LENGTH];
-    strncpy(buf, line, MAX_LINE_LENGTH);
-    buf[MAX_LINE_LENGTH-1] = '\0';
-
-    /* strip label */
-    char *instr = strchr(buf, ':');
-    if (instr) instr++;
-    else instr = buf;
+/* True once the current file has reported --max-errors errors */
+bool error_limit_reached(void) {
+    return opt_max_errors > 0 && error_count >= opt_max_errors;
+}
 
-    /* parse opcode and operands */
-    char *opc = strtok(instr, " \t\n");
-    if (!opc) return true;  /* nothing to do */
+/* Records an error of the current file; line and column are 0 when unknown.
+   The error is printed right away unless --diagnostics=json was given. */
+void report_error(int line, int column, const char *code, const char *format, ...) {
+    Diagnostic *diag;
+    va_list args;
 
-    const OpcodeInfo *info = find_opcode(opc);
-    if (!info) {
-        fprintf(stderr, "%s:%d: error: unknown opcode '%s'\n", file_name, line_num, opc);
-        return false;
-    }
+    if (diagnostics_muted || error_limit_reached()) return;
 
-    /* count operands */
-    char *op1 = strtok(NULL, ", \t\n");
-    char *op2 = strtok(NULL, ", \t\n");
-    int count = (op2 ? 2 : (op1 ? 1 : 0));
-    if (count != info->num_operands) {
-        fprintf(stderr, "%s:%d: error: '%s' expects %d operands, got %d\n",
-                file_name, line_num, opc, info->num_operands, count);
-        return false;
+    /* the passes count .am lines, the message names the source */
+    if (diagnostic_lines && line > 0 && line <= diagnostic_lines->count) {
+        line = diagnostic_lines->lines[line - 1];
     }
 
-    /* check addressing modes */
-    if (op1) {
-        int m1 = detect_addressing_mode(op1);
-        if (!(info->src_mask & (1<<m1))) {
-            fprintf(stderr, "%s:%d: error: addressing mode %d not allowed for source of '%s'\n",
-                    file_name, line_num, m1, opc);
-            return false;
-        }
+    diag = malloc(sizeof(Diagnostic));
+    if (!diag) {
+        fprintf(stderr, "%s: error: memory allocation failed for diagnostic\n", diagnostic_file);
+        return;
     }
-    if (op2) {
-        int m2 = detect_addressing_mode(op2);
-        if (!(info->dst_mask & (1<<m2))) {
-            fprintf(stderr, "%s:%d: error: addressing mode %d not allowed for dest of '%s'\n",
-                    file_name, line_num, m2, opc);
-            return false;
+    va_start(args, format);
+    vsnprintf(diag->message, ERROR_LENGTH, format, args);
+    va_end(args);
+    diag->line   = line;
+    diag->column = column;
+    diag->code   = code;
+    diag->next   = NULL;
+    if (diagnostic_tail) diagnostic_tail->next = diag;
+    else                 diagnostic_head = diag;
+    diagnostic_tail = diag;
+    error_count++;
+    total_errors++;
+
+    if (!opt_diag_json) {
+        fprintf(stderr, "%s:", diagnostic_file);
+        if (line > 0)   fprintf(stderr, "%d:", line);
+        if (column > 0) fprintf(stderr, "%d:", column);
+        fprintf(stderr, " error: %s [%s]\n", diag->message, code);
+        if (error_limit_reached()) {
+            fprintf(stderr, "%s: too many errors (%d), stopping\n", diagnostic_file, error_count);
         }
     }
-    return true;
 }
 
-
-void add_macro(const char *name, const char *content) {
-    Macro *new_macro = (Macro *)malloc(sizeof(Macro));
-    if (!new_macro) {
-        printf("Error: memory allocation failed for macro.\n");
-        return;
+/* Writes s as a JSON string literal */
+void print_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c == '\n')         fputs("\\n", out);
+        else if (c == '\t')         fputs("\\t", out);
+        else if (c < 0x20)          fprintf(out, "\\u%04x", c);
+        else                        fputc(c, out);
     }
+    fputc('"', out);
+}
 
-    strcpy(new_macro->name, name);
-    strcpy(new_macro->content, content);
-    new_macro->next = macro_table;
-    macro_table = new_macro;
+/* --diagnostics=json: one line per source file,
+   {"file":..., "errors":N, "diagnostics":[{"line":..,"column":..,"severity":"error","code":..,"message":..}]} */
+void print_diagnostics_json(FILE *out) {
+    Diagnostic *diag;
+
+    fputs("{\"file\":", out);
+    print_json_string(out, diagnostic_file);
+    fprintf(out, ",\"errors\":%d,\"diagnostics\":[", error_count);
+    for (diag = diagnostic_head; diag; diag = diag->next) {
+        fprintf(out, "%s{\"line\":%d,\"column\":%d,\"severity\":\"error\",\"code\":",
+                diag == diagnostic_head ? "" : ",", diag->line, diag->column);
+        print_json_string(out, diag->code);
+        fputs(",\"message\":", out);
+        print_json_string(out, diag->message);
+        fputc('}', out);
+    }
+    fputs("]}\n", out);
+    fflush(out);
 }
 
-bool macro_exists(const char *name) {
-    Macro *cur = macro_table;
-    while (cur) {
-        if (strcmp(cur->name, name) == 0) return true;
-        cur = cur->next;
+/* Ends the current file: prints its JSON line if asked for, returns true when it had no errors */
+bool finish_diagnostics(void) {
+    if (opt_diag_json) {
+        print_diagnostics_json(stderr);
     }
-    return false;
+    return error_count == 0;
 }
 
+/* Interned strings: every distinct label (and instruction line) of the file being assembled
+   is stored once in an arena of blocks that never move, and is named by its NameId */
+#define INTERN_BLOCK_SIZE 16384
+
+typedef struct InternBlock {
+    char *text;
+    size_t used;
+    size_t size;
+    struct InternBlock *next;
+} InternBlock;
+
+InternBlock *intern_blocks = NULL;  /* newest first */
+const char **intern_names = NULL;   /* NameId -> text, entry 0 unused */
+NameId intern_count = 0;            /* highest NameId handed out */
+NameId intern_capacity = 0;         /* entries allocated in intern_names */
+NameId *intern_table = NULL;        /* open addressing over NameIds, 0 is an empty slot */
+unsigned long intern_table_size = 0;    /* a power of two */
+
+/* FNV-1a hash of a label name */
+unsigned long hash_name(const char *name) {
+    unsigned long h = 2166136261UL;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619UL;
+        h &= 0xFFFFFFFFUL;
+    }
+    return h;
+}
 
-void preprocess_file(const char *input_filename, const char *output_filename) {
-    FILE *input_fp = fopen(input_filename, "r");
-    FILE *output_fp = fopen(output_filename, "w");
-    char line[MAX_LINE_LENGTH];
-    char macro_name[MAX_LINE_LENGTH];
-    char macro_content[MAX_LINE_LENGTH * 10];
-    bool in_macro = false;
+/* Text of an interned name; "" for NO_NAME */
+const char *name_text(NameId id) {
+    return id != NO_NAME && id <= intern_count ? intern_names[id] : "";
+}
 
-    if (!input_fp || !output_fp) {
-        fprintf(stderr, "Error: failed to open %s or %s\n", input_filename, output_filename);
-        return;
+/* Slot of name in intern_table, or of the empty slot where it would go */
+unsigned long intern_slot(const char *name, unsigned long h) {
+    unsigned long mask = intern_table_size - 1;
+    unsigned long i = h & mask;
+    while (intern_table[i] != NO_NAME && strcmp(intern_names[intern_table[i]], name) != 0) {
+        i = (i + 1) & mask;
     }
+    return i;
+}
 
-    while (fgets(line, MAX_LINE_LENGTH, input_fp)) {
-        /* התחלת הגדרת מאקרו */
-        if (strncmp(line, "macro", 5) == 0) {
-            if (in_macro) {
-                fprintf(stderr, "%s: error: nested macro definitions not allowed\n", input_filename);
-                return;
-            }
-            sscanf(line, "macro %s", macro_name);
-            if (macro_exists(macro_name)) {
-                fprintf(stderr, "%s: error: duplicate macro '%s'\n", input_filename, macro_name);
-                return;
-            }
-            in_macro = true;
-            macro_content[0] = '\0';
-            continue;
-        }
+/* Returns the NameId of name if it was interned, NO_NAME otherwise */
+NameId lookup_name(const char *name) {
+    if (intern_table_size == 0) return NO_NAME;
+    return intern_table[intern_slot(name, hash_name(name))];
+}
 
-        /* סוף הגדרת מאקרו */
-        if (in_macro && strncmp(line, "endmacro", 8) == 0) {
-            in_macro = false;
-            add_macro(macro_name, macro_content);
-            continue;
+/* Copies text into the arena and returns its lasting address */
+char *intern_store(const char *text, size_t length) {
+    InternBlock *block = intern_blocks;
+    char *copy;
+
+    if (!block || block->used + length + 1 > block->size) {
+        size_t size = length + 1 > INTERN_BLOCK_SIZE ? length + 1 : INTERN_BLOCK_SIZE;
+        block = malloc(sizeof(InternBlock));
+        if (!block) return NULL;
+        block->text = malloc(size);
+        if (!block->text) {
+            free(block);
+            return NULL;
         }
+        block->used = 0;
+        block->size = size;
+        block->next = intern_blocks;
+        intern_blocks = block;
+    }
+    copy = block->text + block->used;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    block->used += length + 1;
+    return copy;
+}
 
-        if (in_macro) {
-            /* בתוך מאקרו – מצטבר לתוכן */
-            strcat(macro_content, line);
-        } else {
-            /* מחוץ למאקרו – כותב לשורה ב־.pre */
-            fprintf(output_fp, "%s", line);
+/* Doubles the hash table (kept at most half full) and the NameId -> text map as needed */
+bool intern_reserve(void) {
+    if (intern_count + 1 >= intern_capacity) {
+        NameId capacity = intern_capacity ? intern_capacity * 2 : 256;
+        const char **names = realloc((void *)intern_names, capacity * sizeof(const char *));
+        if (!names) return false;
+        intern_names    = names;
+        intern_capacity = capacity;
+    }
+    if ((intern_count + 1) * 2 > intern_table_size) {
+        unsigned long size = intern_table_size ? intern_table_size * 2 : 512;
+        NameId *old = intern_table, *table = calloc(size, sizeof(NameId));
+        NameId id;
+        if (!table) return false;
+        intern_table      = table;
+        intern_table_size = size;
+        for (id = 1; id <= intern_count; id++) {
+            intern_table[intern_slot(intern_names[id], hash_name(intern_names[id]))] = id;
         }
+        free(old);
     }
+    return true;
+}
 
-    if (in_macro) {
-        fprintf(stderr, "%s: error: missing endmacro for '%s'\n", input_filename, macro_name);
-    }
+/* Returns the NameId of name, storing it the first time it is seen */
+NameId intern_name(const char *name) {
+    NameId id = lookup_name(name);
+    char *copy;
 
-    fclose(input_fp);
-    fclose(output_fp);
+    if (id != NO_NAME) return id;
+    if (!intern_reserve() || !(copy = intern_store(name, strlen(name)))) {
+        report_error(0, 0, "alloc", "memory allocation failed for name '%s'", name);
+        return NO_NAME;
+    }
+    id = ++intern_count;
+    intern_names[id] = copy;
+    intern_table[intern_slot(copy, hash_name(copy))] = id;
+    return id;
 }
 
-void expand_macros(const char *input_filename, const char *output_filename) {
-    FILE *input_fp = fopen(input_filename, "r");
-    FILE *output_fp = fopen(output_filename, "w");
-    char line[MAX_LINE_LENGTH];
-    Macro *curr_macro;
+/* Interned copy of an instruction line; equal lines share their text */
+const char *intern_line(const char *line) {
+    return name_text(intern_name(line));
+}
 
-    if (!input_fp || !output_fp) {
-        printf("Error: failed to open file(s) in expand_macros.\n");
-        return;
+/* Forgets every interned string, called with the rest of the per-file state. The newest
+   block and the tables are kept for the next file, so a run over many small sources (or a
+   server) does not allocate them again */
+void clear_interned_names(void) {
+    InternBlock *block, *next;
+    if (!intern_blocks) return;
+    for (block = intern_blocks->next; block; block = next) {
+        next = block->next;
+        free(block->text);
+        free(block);
     }
+    intern_blocks->next = NULL;
+    intern_blocks->used = 0;
+    if (intern_table) memset(intern_table, 0, intern_table_size * sizeof(NameId));
+    intern_count = 0;
+}
 
-    while (fgets(line, MAX_LINE_LENGTH, input_fp)) {
-        int matched = 0;
-
-        /* Trim leading spaces */
-        char *trimmed = line;
-        while (isspace(*trimmed)) trimmed++;
-
-        /* Try to match with a macro name */
-        curr_macro = macro_table;
-        while (curr_macro != NULL) {
-            if (strncmp(trimmed, curr_macro->name, strlen(curr_macro->name)) == 0 &&
-                isspace(trimmed[strlen(curr_macro->name)]) || trimmed[strlen(curr_macro->name)] == '\n') {
-                fprintf(output_fp, "%s", curr_macro->content);
-                matched = 1;
-                break;
-                }
-            curr_macro = curr_macro->next;
-        }
-
-        if (!matched) {
-            fprintf(output_fp, "%s", line);  /* Not a macro, write as-is */
+/* Symbol lookup: the name is resolved to its NameId once, then compared as an integer */
+Symbol *find_symbol_id(NameId name) {
+    Symbol *cur;
+    if (name == NO_NAME) return NULL;
+    for (cur = symbol_table_head; cur; cur = cur->next) {
+        if (cur->name == name) {
+            return cur;
         }
     }
+    return NULL;
+}
 
-    fclose(input_fp);
-    fclose(output_fp);
+Symbol *find_symbol(const char *name) {
+    return find_symbol_id(lookup_name(name));
 }
 
+/* Operand and .data expressions: decimal numbers, labels (their address), unary - and +,
+   binary + - * / % and parentheses, e.g. #LEN-1, TABLE+3, .data 2*8, .data END-START.
+   An expression without labels is folded where it is read. One with labels is evaluated
+   once the final addresses are known, and is kept as a fixup so it follows them. */
+typedef struct {
+    const char *p;                  /* next character */
+    char error[ERROR_LENGTH];       /* first error, empty if none */
+    bool linear;                    /* false once a label was multiplied or divided */
+} Expression;
 
-/* Checks if a line starts with a label (ends with a colon) */
-bool is_label(const char *line) {
-    const char *colon;
-    const char *p;
+/* A value and how it follows the segments: moving segment s by n words changes it by
+   moves[s] * n. A label has 1 for its own segment, a number has none. */
+typedef struct {
+    long value;
+    int moves[SEGMENT_COUNT];
+} Term;
 
-    /* Skip leading spaces or tabs */
-    while (*line == ' ' || *line == '\t') {
-        line++;
+void parse_sum(Expression *e, Term *t);
+
+/* t = a * t, for a number a */
+void scale_term(Term *t, long a) {
+    int s;
+    t->value *= a;
+    for (s = 0; s < SEGMENT_COUNT; s++) t->moves[s] *= (int)a;
+}
+
+/* True when t follows some segment */
+bool term_moves(const Term *t) {
+    int s;
+    for (s = 0; s < SEGMENT_COUNT; s++) {
+        if (t->moves[s]) return true;
     }
+    return false;
+}
 
-    /* Look for a colon (':') which indicates a label */
-    colon = strchr(line, ':');
-    if (!colon) {
-        return false;
+void parse_primary(Expression *e, Term *t) {
+    char name[MAX_LINE_LENGTH];
+    char *end;
+    Symbol *sym;
+    size_t n = 0;
+
+    memset(t, 0, sizeof(*t));
+    if (*e->p == '(') {
+        e->p++;
+        parse_sum(e, t);
+        if (*e->p == ')') e->p++;
+        else if (!e->error[0]) sprintf(e->error, "missing ')'");
+    } else if (isdigit((unsigned char)*e->p)) {
+        t->value = strtol(e->p, &end, 10);
+        e->p = end;
+    } else if (isalpha((unsigned char)*e->p) || *e->p == '_') {
+        while ((isalnum((unsigned char)*e->p) || *e->p == '_') && n < MAX_LINE_LENGTH - 1) {
+            name[n++] = *e->p++;
+        }
+        name[n] = '\0';
+        sym = find_symbol(name);
+        if (!sym) {
+            if (!e->error[0]) sprintf(e->error, "undefined label '%s'", name);
+        } else if (sym->is_external) {
+            if (!e->error[0]) sprintf(e->error, "external label '%s' cannot be used", name);
+        } else {
+            t->value = sym->address;
+            t->moves[sym->is_bss ? SEGMENT_BSS : sym->is_data ? SEGMENT_DATA : SEGMENT_CODE] = 1;
+        }
+    } else if (!e->error[0]) {
+        if (*e->p) sprintf(e->error, "unexpected '%c'", *e->p);
+        else       sprintf(e->error, "missing value");
     }
+}
 
-    /* Check that all characters before the ':' are alphanumeric */
-    for (p = line; p < colon; p++) {
-        if (!isalnum(*p)) {
-            return false;
+void parse_unary(Expression *e, Term *t) {
+    if (*e->p == '-') {
+        e->p++;
+        parse_unary(e, t);
+        scale_term(t, -1);
+        return;
+    }
+    if (*e->p == '+') {
+        e->p++;
+    }
+    parse_primary(e, t);
+}
+
+void parse_product(Expression *e, Term *t) {
+    Term rhs;
+    char op;
+
+    parse_unary(e, t);
+    while (*e->p == '*' || *e->p == '/' || *e->p == '%') {
+        op = *e->p++;
+        parse_unary(e, &rhs);
+        if (op == '*') {
+            if (term_moves(t) && term_moves(&rhs)) e->linear = false;
+            if (term_moves(&rhs)) {
+                scale_term(&rhs, t->value);
+                *t = rhs;
+            } else {
+                scale_term(t, rhs.value);
+            }
+        } else if (rhs.value == 0) {
+            if (!e->error[0]) sprintf(e->error, "division by zero");
+        } else {
+            if (term_moves(t) || term_moves(&rhs)) e->linear = false;
+            t->value = op == '/' ? t->value / rhs.value : t->value % rhs.value;
         }
     }
+}
+
+void parse_sum(Expression *e, Term *t) {
+    Term rhs;
+    int s;
+    char op;
+
+    parse_product(e, t);
+    while (*e->p == '+' || *e->p == '-') {
+        op = *e->p++;
+        parse_product(e, &rhs);
+        if (op == '-') scale_term(&rhs, -1);
+        t->value += rhs.value;
+        for (s = 0; s < SEGMENT_COUNT; s++) t->moves[s] += rhs.moves[s];
+    }
+}
 
+/* True when text names no labels, so it can be folded right away */
+bool is_constant_expression(const char *text) {
+    for (; *text; text++) {
+        if (isalpha((unsigned char)*text) || *text == '_') return false;
+    }
     return true;
 }
 
+/* True when text is a plain label name */
+bool is_label_name(const char *text) {
+    if (!isalpha((unsigned char)*text)) return false;
+    while (isalnum((unsigned char)*text) || *text == '_') text++;
+    return *text == '\0';
+}
 
-/* Checks if the line contains a directive like .data or .string */
-bool is_directive(const char *line) {
-    const char *p;
+/* Evaluates text with the current label addresses into t; linear is false when the
+   value cannot follow the segments of its labels. On failure returns false and leaves the
+   message in error[] (ERROR_LENGTH bytes). */
+bool evaluate_term(const char *text, Term *t, bool *linear, char *error) {
+    Expression e;
+    e.p = text;
+    e.error[0] = '\0';
+    e.linear = true;
+    parse_sum(&e, t);
+    if (!e.error[0] && *e.p) {
+        sprintf(e.error, "unexpected '%c'", *e.p);
+    }
+    if (e.error[0]) {
+        sprintf(error, "%s in expression '%.80s'", e.error, text);
+        return false;
+    }
+    *linear = e.linear;
+    return true;
+}
 
-    /* Skip leading whitespace */
-    while (*line == ' ' || *line == '\t') {
-        line++;
+bool evaluate_expression(const char *text, long *value, char *error) {
+    Term t;
+    bool linear;
+    if (!evaluate_term(text, &t, &linear, error)) return false;
+    *value = t.value;
+    return true;
+}
+
+/* Records that the word at address holds expr, to be evaluated by resolve_expressions */
+void add_expression_fixup(const char *expr, int address, int line_number) {
+    Fixup *fixup = malloc(sizeof(Fixup));
+    if (!fixup) {
+        report_error(line_number, 0, "alloc", "memory allocation failed for fixup");
+        return;
     }
+    memset(fixup, 0, sizeof(*fixup));
+    fixup->address     = address;
+    fixup->symbol      = NULL;
+    fixup->expr        = intern_line(expr);
+    fixup->line_number = line_number;
+    fixup->linear      = true;
+    fixup->next        = fixup_head;
+    fixup_head         = fixup;
+}
 
-    /* If there's a label, skip past it */
-    p = strchr(line, ':');
-    if (p) {
-        line = p + 1;
-        while (*line == ' ' || *line == '\t') {
-            line++;
-        }
+/* Value of a .data/.mat word at address: folded now, or 0 until resolve_expressions */
+Word data_word(const char *text, int address, int line_number, int column) {
+    char error[ERROR_LENGTH];
+    long value = 0;
+
+    if (!is_constant_expression(text)) {
+        add_expression_fixup(text, address, line_number);
+    } else if (!evaluate_expression(text, &value, error)) {
+        report_error(line_number, column, "expression", "%s", error);
     }
+    return (Word)value;
+}
 
-    /* Check for known directives */
-    if (strncmp(line, ".data", 5) == 0 ||
-        strncmp(line, ".string", 7) == 0 ||
-        strncmp(line, ".extern", 7) == 0 ||
-        strncmp(line, ".entry", 6) == 0) {
-        return true;
+/* Stores the value of every expression fixup, once label addresses are final */
+void resolve_expressions(void) {
+    char error[ERROR_LENGTH];
+    Fixup *fixup;
+    Term t;
+    int s;
+
+    for (fixup = fixup_head; fixup; fixup = fixup->next) {
+        if (!fixup->expr) continue;
+        if (evaluate_term(fixup->expr, &t, &fixup->linear, error)) {
+            memory[fixup->address] = (Word)t.value;
+            for (s = 0; s < SEGMENT_COUNT; s++) fixup->moves[s] = t.moves[s];
+        } else {
+            report_error(fixup->line_number, 0, "expression", "%s", error);
         }
-
-    return false;
+    }
 }
 
+int detect_addressing_mode(const char *operand);
 
-/* Checks if the line contains a valid instruction */
-bool is_instruction(const char *line) {
-    const char *p;
+/* Number of the register named by text[0..length), e.g. r3, or -1 if it names none */
+int register_number(const char *text, int length) {
+    int i, number = 0;
 
-    /* Skip leading whitespace */
-    while (*line == ' ' || *line == '\t') {
-        line++;
+    if (length < 2 || text[0] != 'r' || (text[1] == '0' && length > 2)) return -1;
+    for (i = 1; i < length; i++) {
+        if (!isdigit((unsigned char)text[i]) || number >= REGISTER_COUNT) return -1;
+        number = number * 10 + (text[i] - '0');
     }
+    return number < REGISTER_COUNT ? number : -1;
+}
 
-    /* If there's a label, skip past it */
-    p = strchr(line, ':');
-    if (p) {
-        line = p + 1;
-        while (*line == ' ' || *line == '\t') {
-            line++;
-        }
-    }
-
-    /* Check for known instructions */
-    if (strncmp(line, "mov", 3) == 0 ||
-        strncmp(line, "add", 3) == 0 ||
-        strncmp(line, "sub", 3) == 0 ||
-        strncmp(line, "cmp", 3) == 0 ||
-        strncmp(line, "lea", 3) == 0 ||
-        strncmp(line, "clr", 3) == 0 ||
-        strncmp(line, "not", 3) == 0 ||
-        strncmp(line, "inc", 3) == 0 ||
-        strncmp(line, "dec", 3) == 0 ||
-        strncmp(line, "jmp", 3) == 0 ||
-        strncmp(line, "bne", 3) == 0 ||
-        strncmp(line, "jsr", 3) == 0 ||
-        strncmp(line, "red", 3) == 0 ||
-        strncmp(line, "prn", 3) == 0 ||
-        strncmp(line, "rts", 3) == 0 ||
-        strncmp(line, "stop", 4) == 0) {
-        return true;
-        }
+/* ---- Lexer: each line is scanned once, by a table-driven automaton, into typed tokens ---- */
 
-    return false;
+enum {
+    TOKEN_NAME, TOKEN_LABEL, TOKEN_MNEMONIC, TOKEN_DIRECTIVE, TOKEN_REGISTER, TOKEN_NUMBER,
+    TOKEN_STRING, TOKEN_HASH, TOKEN_COLON, TOKEN_COMMA, TOKEN_OPEN, TOKEN_CLOSE,
+    TOKEN_OPERATOR, TOKEN_COMMENT, TOKEN_ERROR
+};
+
+typedef struct {
+    int type;
+    int start;      /* offset in the line */
+    int length;
+} Token;
+
+/* Character classes, and the class of every ASCII character (others are CC_OTHER) */
+enum { CC_SPACE, CC_LETTER, CC_DIGIT, CC_DOT, CC_QUOTE, CC_SEMI, CC_PUNCT, CC_END, CC_OTHER, CHAR_CLASSES };
+
+static const char lex_class_of[] =
+    "7888888880700088"      /* NUL, tab, newline, \v \f \r */
+    "8888888888888888"
+    "0846868866666636"      /* space ! " # $ % & ' ( ) * + , - . / */
+    "2222222222658888"      /* 0-9 : ; < = > ? */
+    "8111111111111111"      /* @ A-O */
+    "1111111111168681"      /* P-Z [ \ ] ^ _ */
+    "8111111111111111"      /* ` a-o */
+    "1111111111188888";     /* p-z { | } ~ DEL */
+
+#define CHAR_CLASS(c) ((unsigned char)(c) < 128 ? lex_class_of[(unsigned char)(c)] - '0' : CC_OTHER)
+
+/* States of the automaton; LS_DONE ends a token before the current character */
+enum { LS_START, LS_NAME, LS_NUMBER, LS_DOT, LS_DIRECTIVE, LS_STRING, LS_STRING_END, LS_SINGLE,
+       LS_COMMENT, LS_DONE };
+
+static const unsigned char lex_next[LS_DONE][CHAR_CLASSES] = {
+    /*               SPACE       LETTER        DIGIT       DOT        QUOTE          SEMI        PUNCT      END      OTHER */
+    /* START */     {LS_START,   LS_NAME,      LS_NUMBER,  LS_DOT,    LS_STRING,     LS_COMMENT, LS_SINGLE, LS_DONE, LS_SINGLE},
+    /* NAME */      {LS_DONE,    LS_NAME,      LS_NAME,    LS_DONE,   LS_DONE,       LS_DONE,    LS_DONE,   LS_DONE, LS_DONE},
+    /* NUMBER */    {LS_DONE,    LS_DONE,      LS_NUMBER,  LS_DONE,   LS_DONE,       LS_DONE,    LS_DONE,   LS_DONE, LS_DONE},
+    /* DOT */       {LS_DONE,    LS_DIRECTIVE, LS_DONE,    LS_DONE,   LS_DONE,       LS_DONE,    LS_DONE,   LS_DONE, LS_DONE},
+    /* DIRECTIVE */ {LS_DONE,    LS_DIRECTIVE, LS_DONE,    LS_DONE,   LS_DONE,       LS_DONE,    LS_DONE,   LS_DONE, LS_DONE},
+    /* STRING */    {LS_STRING,  LS_STRING,    LS_STRING,  LS_STRING, LS_STRING_END, LS_STRING,  LS_STRING, LS_DONE, LS_STRING},
+    /* STRING_END */{LS_DONE,    LS_DONE,      LS_DONE,    LS_DONE,   LS_DONE,       LS_DONE,    LS_DONE,   LS_DONE, LS_DONE},
+    /* SINGLE */    {LS_DONE,    LS_DONE,      LS_DONE,    LS_DONE,   LS_DONE,       LS_DONE,    LS_DONE,   LS_DONE, LS_DONE},
+    /* COMMENT */   {LS_COMMENT, LS_COMMENT,   LS_COMMENT, LS_COMMENT,LS_COMMENT,    LS_COMMENT, LS_COMMENT,LS_DONE, LS_COMMENT}
+};
+
+/* What a line holds once its tokens are known */
+enum { STATEMENT_EMPTY, STATEMENT_DIRECTIVE, STATEMENT_INSTRUCTION, STATEMENT_UNKNOWN };
+
+/* Operands kept per statement; two at most are valid, a third one shows there are too many */
+#define MAX_OPERANDS 3
+
+typedef struct {
+    Token tokens[MAX_LINE_LENGTH];
+    int token_count;
+    int label;          /* index of the label token, -1 if none */
+    int head;           /* index of the mnemonic, directive or unknown name, -1 if none */
+    int kind;
+    int operand_count;  /* of an instruction, operands are split at commas */
+    int operand_first[MAX_OPERANDS];    /* token range [first, end) of each operand */
+    int operand_end[MAX_OPERANDS];
+} Statement;
+
+/* Known directives; .include is handled before the first pass */
+static const char *directive_names[] = {".data", ".string", ".extern", ".entry", ".mat", ".space", ".zero"};
+
+bool token_is(const char *line, const Token *token, const char *text) {
+    return strlen(text) == (size_t)token->length && strncmp(line + token->start, text, token->length) == 0;
 }
 
+/* Copies the text of a token (at most MAX_LINE_LENGTH - 1 characters) */
+void token_text(const char *line, const Token *token, char *out) {
+    int length = token->length < MAX_LINE_LENGTH ? token->length : MAX_LINE_LENGTH - 1;
+    memcpy(out, line + token->start, length);
+    out[length] = '\0';
+}
 
-/* Detects addressing mode of an operand */
-int detect_addressing_mode(const char *operand) {
-    if (!operand) return -1; /* No operand */
+/* Scans line into tokens, then finds its label, its head and its operands */
+void lex_line(const char *line, Statement *st) {
+    static const char punct[] = "#:,[]+-*/%()";
+    static const int punct_type[] = {TOKEN_HASH, TOKEN_COLON, TOKEN_COMMA, TOKEN_OPEN, TOKEN_CLOSE,
+                                     TOKEN_OPERATOR, TOKEN_OPERATOR, TOKEN_OPERATOR, TOKEN_OPERATOR,
+                                     TOKEN_OPERATOR, TOKEN_OPERATOR, TOKEN_OPERATOR};
+    const char *p = line, *at;
+    Token *token;
+    char name[MAX_LINE_LENGTH];
+    int state, next, i, first;
+    size_t k;
+
+    st->token_count = 0;
+    st->label = st->head = -1;
+    st->kind = STATEMENT_EMPTY;
+    st->operand_count = 0;
+
+    for (;;) {
+        while (CHAR_CLASS(*p) == CC_SPACE) p++;
+        if (CHAR_CLASS(*p) == CC_END) break;
+
+        token = &st->tokens[st->token_count++];
+        token->start = (int)(p - line);
+        state = lex_next[LS_START][CHAR_CLASS(*p)];
+        p++;
+        while ((next = lex_next[state][CHAR_CLASS(*p)]) != LS_DONE) {
+            state = next;
+            p++;
+        }
+        token->length = (int)(p - line) - token->start;
 
-    /* Immediate addressing: starts with '#' */
-    if (operand[0] == '#') {
-        return 0;
+        switch (state) {
+        case LS_NAME:
+            token->type = TOKEN_NAME;
+            if (register_number(line + token->start, token->length) >= 0) {
+                token->type = TOKEN_REGISTER;
+            }
+            break;
+        case LS_NUMBER:     token->type = TOKEN_NUMBER;    break;
+        case LS_DIRECTIVE:  token->type = TOKEN_DIRECTIVE; break;
+        case LS_STRING_END: token->type = TOKEN_STRING;    break;
+        case LS_COMMENT:    token->type = TOKEN_COMMENT;   break;
+        case LS_SINGLE:
+            at = strchr(punct, line[token->start]);
+            token->type = at ? punct_type[at - punct] : TOKEN_ERROR;
+            break;
+        default:            token->type = TOKEN_ERROR;     break;   /* a lone '.', an open string */
+        }
+        if (token->type == TOKEN_COMMENT) {
+            st->token_count--;                  /* the rest of the line is a comment */
+            break;
+        }
     }
 
-    /* Register addressing: starts with 'r' followed by digit (e.g., r3) */
-    if (operand[0] == 'r' && isdigit(operand[1]) && operand[2] == '\0') {
-        return 3;
+    /* a label is a name written right before a colon, at the start of the line */
+    i = 0;
+    if (st->token_count >= 2 && st->tokens[0].type == TOKEN_NAME && st->tokens[1].type == TOKEN_COLON &&
+        st->tokens[1].start == st->tokens[0].start + st->tokens[0].length) {
+        st->tokens[0].type = TOKEN_LABEL;
+        st->label = 0;
+        i = 2;
+    }
+    if (i >= st->token_count) {
+        if (st->label >= 0) st->kind = STATEMENT_UNKNOWN;
+        return;
     }
 
-    /* Index addressing: contains brackets like LABEL[r2] */
-    if (strchr(operand, '[') && strchr(operand, ']')) {
-        return 2;
+    st->head = i;
+    token = &st->tokens[i];
+    st->kind = STATEMENT_UNKNOWN;
+    if (token->type == TOKEN_DIRECTIVE) {
+        for (k = 0; k < sizeof(directive_names) / sizeof(directive_names[0]); k++) {
+            if (token_is(line, token, directive_names[k])) st->kind = STATEMENT_DIRECTIVE;
+        }
+        return;
+    }
+    if (token->type != TOKEN_NAME) {
+        st->head = -1;
+        return;
+    }
+    token_text(line, token, name);
+    if (find_opcode(name)) {
+        token->type = TOKEN_MNEMONIC;
+        st->kind = STATEMENT_INSTRUCTION;
     }
 
-    /* Otherwise it's direct addressing */
-    return 1;
+    /* operands, split at commas */
+    first = st->head + 1;
+    if (first == st->token_count) return;
+    for (i = first; i <= st->token_count; i++) {
+        if (i < st->token_count && st->tokens[i].type != TOKEN_COMMA) continue;
+        if (st->operand_count < MAX_OPERANDS) {
+            st->operand_first[st->operand_count] = first;
+            st->operand_end[st->operand_count]   = i;
+        }
+        st->operand_count++;
+        first = i + 1;
+    }
 }
 
+/* Copies operand k of an instruction with its tokens joined, so "K[ r2 ]" reads "K[r2]" */
+void operand_text(const char *line, const Statement *st, int k, char *out) {
+    int i, length = 0;
+    const Token *token;
 
-/* Parses an instruction line and prints its parts */
-void parse_instruction(const char *line) {
-    char copy[MAX_LINE_LENGTH];
-    char *label = NULL;
-    char *opcode;
-    char *operand1 = NULL;
-    char *operand2 = NULL;
-
-    /* Make a copy because strtok modifies the string */
-    strncpy(copy, line, MAX_LINE_LENGTH);
-    copy[MAX_LINE_LENGTH - 1] = '\0';
-
-    /* If there's a label, skip it */
-    char *colon = strchr(copy, ':');
-    if (colon) {
-        label = strtok(copy, ":");
-        opcode = strtok(NULL, " \t\n");
-    } else {
-        opcode = strtok(copy, " \t\n");
+    for (i = st->operand_first[k]; i < st->operand_end[k]; i++) {
+        token = &st->tokens[i];
+        if (length + token->length >= MAX_LINE_LENGTH) break;
+        memcpy(out + length, line + token->start, token->length);
+        length += token->length;
     }
+    out[length] = '\0';
+}
 
-    /* Get first operand */
-    operand1 = strtok(NULL, ", \t\n");
+/* Returns the opcode of an instruction line, or NULL */
+const OpcodeInfo *instruction_opcode(const char *line) {
+    Statement st;
+    char name[MAX_LINE_LENGTH];
 
-    /* Get second operand (if exists) */
-    operand2 = strtok(NULL, ", \t\n");
+    lex_line(line, &st);
+    if (st.head < 0) return NULL;
+    token_text(line, &st.tokens[st.head], name);
+    return find_opcode(name);
+}
 
-    printf("==> Instruction parsed:\n");
-    printf("    Opcode: %s\n", opcode);
+/* Splits the operands of an instruction line into ops, returns their number */
+int instruction_operands(const char *line, char ops[2][MAX_LINE_LENGTH]) {
+    Statement st;
+    int k, count;
 
-    if (operand1) {
-        printf("    Operand 1: %s\n", operand1);
-        printf("    Addressing mode 1: %d\n", detect_addressing_mode(operand1));
+    lex_line(line, &st);
+    count = st.operand_count < 2 ? st.operand_count : 2;
+    for (k = 0; k < 2; k++) {
+        ops[k][0] = '\0';
+        if (k < count) operand_text(line, &st, k, ops[k]);
     }
+    return count;
+}
 
-    if (operand2) {
-        printf("    Operand 2: %s\n", operand2);
-        printf("    Addressing mode 2: %d\n", detect_addressing_mode(operand2));
+/* Validate operand count and addressing modes of a lexed instruction; column is where
+   line starts in its source line. Reports the problem when report is set; without it
+   nothing global is touched, so threads may call it. */
+bool check_statement(const char *line, const Statement *st, int line_num, int column, bool report) {
+    char opc[MAX_LINE_LENGTH], ops[MAX_OPERANDS][MAX_LINE_LENGTH];
+    const OpcodeInfo *info;
+    const Token *token;
+    int k, i, mode, count = st->operand_count;
+    int src = -1, dst = -1;     /* operand indexes */
+
+    if (st->head < 0) return true;  /* nothing to do */
+    token_text(line, &st->tokens[st->head], opc);
+    info = find_opcode(opc);
+    if (!info) {
+        if (report) report_error(line_num, column + st->tokens[st->head].start, "unknown-opcode",
+                                 "unknown opcode '%s'", opc);
+        return false;
     }
-}
 
-/* Encodes a single assembly instruction into an integer machine word, Returns the encoded value as an int. */
-int encode_instruction(const char *line) {
-    char copy[MAX_LINE_LENGTH];
-    char *opcode_str, *operand1 = NULL, *operand2 = NULL;
-    int opcode = 0;
-    int src_mode = 0, dst_mode = 0;
-    int instruction_word = 0;
+    /* count operands */
+    if (count != info->num_operands) {
+        if (report) report_error(line_num, column + st->tokens[st->head].start, "operand-count",
+                                 "'%s' expects %d operands, got %d", opc, info->num_operands, count);
+        return false;
+    }
+    for (k = 0; k < count; k++) {
+        if (st->operand_first[k] >= st->operand_end[k]) {
+            token = &st->tokens[st->operand_first[k] < st->token_count ? st->operand_first[k] : st->head];
+            if (report) report_error(line_num, column + token->start, "operand-count",
+                                     "empty operand %d of '%s'", k + 1, opc);
+            return false;
+        }
+        /* two values in a row are two operands without a comma between them */
+        for (i = st->operand_first[k] + 1; i < st->operand_end[k]; i++) {
+            token = &st->tokens[i];
+            if ((token->type == TOKEN_NAME || token->type == TOKEN_REGISTER || token->type == TOKEN_NUMBER) &&
+                (token[-1].type == TOKEN_NAME || token[-1].type == TOKEN_REGISTER || token[-1].type == TOKEN_NUMBER)) {
+                if (report) report_error(line_num, column + token->start, "operand-count",
+                                         "missing ',' between operands of '%s'", opc);
+                return false;
+            }
+        }
+        operand_text(line, st, k, ops[k]);
+    }
 
-    strncpy(copy, line, MAX_LINE_LENGTH);
-    copy[MAX_LINE_LENGTH - 1] = '\0';
+    /* a single operand is the destination */
+    if (count == 2) src = 0;
+    if (count >= 1) dst = count - 1;
 
-    /* Skip label if exists */
-    char *colon = strchr(copy, ':');
-    if (colon) {
-        opcode_str = strtok(colon + 1, " \t\n");
-    } else {
-        opcode_str = strtok(copy, " \t\n");
+    /* check addressing modes */
+    if (src >= 0) {
+        mode = detect_addressing_mode(ops[src]);
+        if (!(info->src_mask & (1<<mode))) {
+            if (report) report_error(line_num, column + st->tokens[st->operand_first[src]].start, "addressing-mode",
+                                     "addressing mode %d not allowed for source of '%s'", mode, opc);
+            return false;
+        }
     }
+    if (dst >= 0) {
+        mode = detect_addressing_mode(ops[dst]);
+        if (!(info->dst_mask & (1<<mode))) {
+            if (report) report_error(line_num, column + st->tokens[st->operand_first[dst]].start, "addressing-mode",
+                                     "addressing mode %d not allowed for dest of '%s'", mode, opc);
+            return false;
+        }
+    }
+    return true;
+}
 
-    /* Read operands */
-    operand1 = strtok(NULL, ", \t\n");
-    operand2 = strtok(NULL, ", \t\n");
+bool check_instruction(const char *line, int line_num, int column, bool report) {
+    Statement st;
+    lex_line(line, &st);
+    return check_statement(line, &st, line_num, column, report);
+}
 
-    /* Translate opcode to number */
-    if (strcmp(opcode_str, "mov") == 0) opcode = 0;
-    else if (strcmp(opcode_str, "cmp") == 0) opcode = 1;
-    else if (strcmp(opcode_str, "add") == 0) opcode = 2;
-    else if (strcmp(opcode_str, "sub") == 0) opcode = 3;
-    else if (strcmp(opcode_str, "not") == 0) opcode = 4;
-    else if (strcmp(opcode_str, "clr") == 0) opcode = 5;
-    else if (strcmp(opcode_str, "lea") == 0) opcode = 6;
-    else if (strcmp(opcode_str, "inc") == 0) opcode = 7;
-    else if (strcmp(opcode_str, "dec") == 0) opcode = 8;
-    else if (strcmp(opcode_str, "jmp") == 0) opcode = 9;
-    else if (strcmp(opcode_str, "bne") == 0) opcode = 10;
-    else if (strcmp(opcode_str, "jsr") == 0) opcode = 11;
-    else if (strcmp(opcode_str, "red") == 0) opcode = 12;
-    else if (strcmp(opcode_str, "prn") == 0) opcode = 13;
-    else if (strcmp(opcode_str, "rts") == 0) opcode = 14;
-    else if (strcmp(opcode_str, "stop") == 0) opcode = 15;
-
-    /* Set addressing modes */
-    if (operand1) {
-        src_mode = detect_addressing_mode(operand1);
-    }
-    if (operand2) {
-        dst_mode = detect_addressing_mode(operand2);
-    }
-
-    /* Build the instruction word:
-       We'll shift bits to encode opcode and modes
-       Format:
-       Bits 0–3: opcode
-       Bits 4–5: src mode
-       Bits 6–7: dst mode
-    */
-    instruction_word |= (opcode & 0xF);          /* 4 bits */
-    instruction_word |= ((src_mode & 0x3) << 4); /* 2 bits */
-    instruction_word |= ((dst_mode & 0x3) << 6); /* 2 bits */
-
-    return instruction_word;
-}
-
-
-void parse_data_directive(const char *line_ptr) {
-    char buffer[MAX_LINE_LENGTH];
-    char *token;
+bool validate_instruction(const char *line, int line_num, int column) {
+    return check_instruction(line, line_num, column, true);
+}
 
-    /* Skip leading whitespace */
-    while (isspace((unsigned char)*line_ptr)) line_ptr++;
 
-    /* .extern directive */
-    if (strncmp(line_ptr, ".extern", 7) == 0) {
-        line_ptr += 7;
-        while (isspace((unsigned char)*line_ptr)) line_ptr++;
+/* Appends a span to a macro's template, growing it as needed */
+bool add_macro_span(Macro *macro, int *capacity, int start, int length, int param) {
+    MacroSpan *spans = (MacroSpan *)macro->spans;
+    if (macro->span_count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        spans = realloc(spans, sizeof(MacroSpan) * *capacity);
+        if (!spans) return false;
+        macro->spans = spans;
+    }
+    spans[macro->span_count].start  = start;
+    spans[macro->span_count].length = length;
+    spans[macro->span_count].param  = param;
+    macro->span_count++;
+    return true;
+}
 
-        char label_name[MAX_LINE_LENGTH];
-        if (sscanf(line_ptr, "%s", label_name) != 1) {
-            fprintf(stderr, "Error: invalid .extern syntax\n");
-            return;
-        }
+/* Frees a macro and, unless they are shared, its compiled spans */
+void free_macro(Macro *macro) {
+    if (!macro->shared) free((MacroSpan *)macro->spans);
+    free(macro);
+}
 
-        Symbol *new_sym = malloc(sizeof(Symbol));
-        if (!new_sym) {
-            fprintf(stderr, "Error: memory allocation failed in .extern\n");
+/* Compiles the body of a macro once into literal spans and parameter slots, so an expansion
+   only copies spans. A parameter is used by writing its name as a whole identifier. */
+bool compile_macro(Macro *macro, char params[][MAX_LINE_LENGTH], int param_count) {
+    const char *text = macro->content, *p = text, *word;
+    int capacity = 0, literal = 0, i;
+    bool ok = true;
+
+    while (*p && ok) {
+        if (!isalpha((unsigned char)*p) && *p != '_') {
+            p++;
+            continue;
+        }
+        word = p;
+        while (isalnum((unsigned char)*p) || *p == '_') p++;
+        for (i = 0; i < param_count; i++) {
+            if (strlen(params[i]) == (size_t)(p - word) && strncmp(word, params[i], p - word) == 0) break;
+        }
+        if (i < param_count) {
+            if (word - text > literal) {
+                ok = add_macro_span(macro, &capacity, literal, (int)(word - text) - literal, -1);
+            }
+            ok = ok && add_macro_span(macro, &capacity, 0, 0, i);
+            literal = (int)(p - text);
+        }
+    }
+    if (ok && p - text > literal) {
+        ok = add_macro_span(macro, &capacity, literal, (int)(p - text) - literal, -1);
+    }
+    return ok;
+}
+
+/* Allocates a macro and compiles its body; returns NULL (after reporting) if out of memory */
+Macro *new_macro(const char *name, const char *content, char params[][MAX_LINE_LENGTH], int param_count) {
+    size_t name_size = strlen(name) + 1;
+    Macro *macro = (Macro *)malloc(sizeof(Macro) + name_size + strlen(content) + 1);
+    char *text;
+    if (!macro) {
+        report_error(0, 0, "alloc", "memory allocation failed for macro '%s'", name);
+        return NULL;
+    }
+
+    text = (char *)(macro + 1);
+    macro->name    = strcpy(text, name);
+    macro->content = strcpy(text + name_size, content);
+    macro->param_count = param_count;
+    macro->spans       = NULL;
+    macro->span_count  = 0;
+    macro->shared      = false;
+    macro->next        = NULL;
+    if (!compile_macro(macro, params, param_count)) {
+        report_error(0, 0, "alloc", "memory allocation failed for macro '%s'", name);
+        free_macro(macro);
+        return NULL;
+    }
+    return macro;
+}
+
+void add_macro(const char *name, const char *content, char params[][MAX_LINE_LENGTH], int param_count) {
+    Macro *macro = new_macro(name, content, params, param_count);
+    if (!macro) return;
+    macro->next = macro_table;
+    macro_table = macro;
+}
+
+bool macro_exists(const char *name) {
+    Macro *cur = macro_table;
+    while (cur) {
+        if (strcmp(cur->name, name) == 0) return true;
+        cur = cur->next;
+    }
+    return false;
+}
+
+/* Splits a comma separated list (macro parameters or arguments) into items, trimming
+   spaces. Returns the number of items, or -1 if there are more than MAX_MACRO_PARAMS
+   or one is empty. */
+int split_macro_list(const char *text, char items[][MAX_LINE_LENGTH]) {
+    const char *end;
+    int count = 0;
+    size_t length;
+
+    while (isspace((unsigned char)*text)) text++;
+    if (*text == '\0') return 0;
+    for (;;) {
+        while (*text == ' ' || *text == '\t') text++;
+        end = text;
+        while (*end && *end != ',' && *end != '\n') end++;
+        length = (size_t)(end - text);
+        while (length > 0 && isspace((unsigned char)text[length - 1])) length--;
+        if (length == 0 || count == MAX_MACRO_PARAMS || length >= MAX_LINE_LENGTH) return -1;
+        memcpy(items[count], text, length);
+        items[count][length] = '\0';
+        count++;
+        if (*end != ',') return count;
+        text = end + 1;
+    }
+}
+
+/* True for a mnemonic, a register or the name of a directive. A macro body is substituted
+   word by word, so a parameter with such a name would replace it there too (in ".data",
+   "data" is a word). */
+bool is_reserved_name(const char *name) {
+    unsigned k;
+
+    if (find_opcode(name) || register_number(name, (int)strlen(name)) >= 0 ||
+        strcmp(name, "include") == 0) {
+        return true;
+    }
+    for (k = 0; k < sizeof(directive_names) / sizeof(directive_names[0]); k++) {
+        if (strcmp(name, directive_names[k] + 1) == 0) return true;
+    }
+    return false;
+}
+
+/* Reads a "macro NAME p1,p2,..." line into name and params. Returns the parameter count,
+   or -1 (after reporting why) when the header is malformed. */
+int parse_macro_header(const char *line, int line_number, char *name, char params[][MAX_LINE_LENGTH]) {
+    char rest[MAX_LINE_LENGTH];
+    int count, i, j;
+
+    rest[0] = '\0';
+    if (sscanf(line, "macro %80s %80[^\n]", name, rest) < 1 || !is_label_name(name)) {
+        report_error(line_number, 1, "macro", "malformed macro definition");
+        return -1;
+    }
+    count = split_macro_list(rest, params);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i && strcmp(params[i], params[j]) != 0; j++)
+            ;
+        if (!is_label_name(params[i]) || j < i) {
+            count = -1;
+        } else if (is_reserved_name(params[i])) {
+            report_error(line_number, 1, "macro", "parameter '%s' of macro '%s' is a reserved word",
+                         params[i], name);
+            return -1;
+        }
+    }
+    if (count < 0) {
+        report_error(line_number, 1, "macro", "bad parameter list for macro '%s' (at most %d distinct names)",
+                     name, MAX_MACRO_PARAMS);
+    }
+    return count;
+}
+
+void normalize_line(const char *line, char *out);
+void reset_assembler_state(void);
+
+/* A file named by .include, read once per process: its lines normalized, with its macro
+   definitions taken out and compiled. Its own .include lines stay in text and are followed
+   each time it is included. */
+typedef struct IncludedFile {
+    char path[FILENAME_MAX];
+    time_t mtime;               /* the file is read again when it changes */
+    off_t size;
+    char *text;
+    size_t text_length;
+    Macro *macros;
+    bool including;             /* set while its lines are emitted, to catch include cycles */
+    unsigned int included_by;   /* the last assembly that included it */
+    struct IncludedFile *next;
+} IncludedFile;
+
+IncludedFile *include_cache = NULL;
+unsigned int include_serial = 1;    /* counts assemblies, bumped by reset_assembler_state */
+
+/* Receives the lines of an included file (file mode writes them to the .pre file, stdin
+   mode assembles them right away) */
+typedef void (*LineSink)(const char *line, int line_number, void *context);
+
+void free_included_file(IncludedFile *file) {
+    Macro *macro, *next_macro;
+    for (macro = file->macros; macro; macro = next_macro) {
+        next_macro = macro->next;
+        free_macro(macro);
+    }
+    free(file->text);
+    file->text   = NULL;
+    file->macros = NULL;
+}
+
+bool append_include_text(IncludedFile *file, const char *line, size_t *capacity) {
+    size_t length = strlen(line);
+    char *text;
+    if (file->text_length + length + 1 > *capacity) {
+        *capacity = (*capacity ? *capacity * 2 : 1024) + length;
+        text = realloc(file->text, *capacity);
+        if (!text) return false;
+        file->text = text;
+    }
+    memcpy(file->text + file->text_length, line, length + 1);
+    file->text_length += length;
+    return true;
+}
+
+/* Reads an included file into its cache entry: normalizes its lines and compiles its
+   macro definitions. Errors are reported at the .include line of the source. */
+bool load_included_file(IncludedFile *file, int line_number) {
+    FILE *fp = fopen(file->path, "r");
+    char raw[MAX_LINE_LENGTH], line[MAX_LINE_LENGTH + 1];
+    char macro_name[MAX_LINE_LENGTH];
+    char macro_content[MAX_LINE_LENGTH * 10];
+    char params[MAX_MACRO_PARAMS][MAX_LINE_LENGTH];
+    Macro *macro, **macro_tail = &file->macros;
+    size_t capacity = 0;
+    int param_count = 0;
+    bool in_macro = false, ok = true;
+
+    if (!fp) {
+        report_error(line_number, 1, "include", "cannot open included file %s", file->path);
+        return false;
+    }
+    file->text_length = 0;
+    ok = append_include_text(file, "", &capacity);
+
+    while (ok && fgets(raw, MAX_LINE_LENGTH, fp)) {
+        normalize_line(raw, line);
+        if (in_macro) {
+            if (strncmp(line, "endmacro", 8) == 0) {
+                in_macro = false;
+                if (param_count >= 0) {
+                    macro = new_macro(macro_name, macro_content, params, param_count);
+                    if (macro) {
+                        *macro_tail = macro;
+                        macro_tail  = &macro->next;
+                    }
+                }
+            } else if (strlen(macro_content) + strlen(line) < sizeof(macro_content)) {
+                strcat(macro_content, line);
+            } else {
+                report_error(line_number, 1, "macro", "macro '%s' in %s is too long", macro_name, file->path);
+            }
+        } else if (strncmp(line, "macro ", 6) == 0) {
+            param_count = parse_macro_header(line, line_number, macro_name, params);
+            in_macro = true;
+            macro_content[0] = '\0';
+        } else {
+            ok = append_include_text(file, line, &capacity);
+        }
+    }
+    if (in_macro) {
+        report_error(line_number, 1, "macro", "missing endmacro for '%s' in %s", macro_name, file->path);
+    }
+    if (!ok) {
+        report_error(line_number, 1, "alloc", "memory allocation failed for %s", file->path);
+    }
+    fclose(fp);
+    return ok;
+}
+
+/* Returns the cache entry of path, reading the file if it is new or has changed since */
+IncludedFile *find_included_file(const char *path, int line_number) {
+    IncludedFile *file;
+    struct stat info;
+
+    if (stat(path, &info) != 0) {
+        report_error(line_number, 1, "include", "cannot open included file %s", path);
+        return NULL;
+    }
+    for (file = include_cache; file; file = file->next) {
+        if (strcmp(file->path, path) == 0) break;
+    }
+    if (file && file->text && file->mtime == info.st_mtime && file->size == info.st_size) {
+        return file;                        /* parsed by an earlier source */
+    }
+
+    if (!file) {
+        file = calloc(1, sizeof(IncludedFile));
+        if (!file) {
+            report_error(line_number, 1, "alloc", "memory allocation failed for %s", path);
+            return NULL;
+        }
+        strncpy(file->path, path, FILENAME_MAX - 1);
+        file->next = include_cache;
+        include_cache = file;
+    }
+    free_included_file(file);
+    file->mtime = info.st_mtime;
+    file->size  = info.st_size;
+    if (!load_included_file(file, line_number)) {
+        free_included_file(file);
+        return NULL;
+    }
+    return file;
+}
+
+void include_file(const char *from, const char *line, int line_number, LineSink emit, void *context);
+
+/* Includes the file at path: its macros are added to the macro table and its lines go to
+   emit, each file at most once per assembly */
+void include_path(const char *path, int line_number, LineSink emit, void *context) {
+    const char *p, *eol;
+    IncludedFile *file;
+    Macro *macro, *copy;
+
+    for (file = include_cache; file; file = file->next) {
+        if (strcmp(file->path, path) == 0 && file->including) {
+            report_error(line_number, 1, "include", "include cycle through %s", path);
             return;
         }
-        strcpy(new_sym->name, label_name);
-        new_sym->address     = 0;
-        new_sym->is_data     = false;
-        new_sym->is_external = true;
-        new_sym->is_entry    = false;
-        new_sym->next        = symbol_table_head;
-        symbol_table_head    = new_sym;
+    }
+    for (file = include_cache; file; file = file->next) {
+        if (strcmp(file->path, path) == 0 && file->included_by == include_serial) return;
+    }
+    file = find_included_file(path, line_number);
+    if (!file) return;
+    file->included_by = include_serial;
+
+    /* the macros are borrowed: the copies share the compiled spans of the cache */
+    for (macro = file->macros; macro; macro = macro->next) {
+        if (macro_exists(macro->name)) {
+            report_error(line_number, 1, "macro", "duplicate macro '%s' from %s", macro->name, path);
+            continue;
+        }
+        copy = (Macro *)malloc(sizeof(Macro));
+        if (!copy) {
+            report_error(line_number, 1, "alloc", "memory allocation failed for macro '%s'", macro->name);
+            return;
+        }
+        *copy = *macro;
+        copy->shared = true;
+        copy->next   = macro_table;
+        macro_table  = copy;
+    }
+
+    file->including = true;
+    for (p = file->text; *p; p = eol) {
+        char piece[MAX_LINE_LENGTH + 1];
+        size_t length;
+        eol = strchr(p, '\n');
+        eol = eol ? eol + 1 : p + strlen(p);
+        length = (size_t)(eol - p) < MAX_LINE_LENGTH ? (size_t)(eol - p) : MAX_LINE_LENGTH;
+        memcpy(piece, p, length);
+        piece[length] = '\0';
+        if (strncmp(piece, ".include ", 9) == 0) {
+            include_file(file->path, piece, line_number, emit, context);
+        } else {
+            emit(piece, line_number, context);
+        }
+    }
+    file->including = false;
+}
+
+/* Follows an .include "NAME" line of the file from; NAME is relative to the directory of from */
+void include_file(const char *from, const char *line, int line_number, LineSink emit, void *context) {
+    char name[MAX_LINE_LENGTH], path[FILENAME_MAX];
+    const char *slash = strrchr(from, '/');
+    size_t dir_length = slash ? (size_t)(slash - from + 1) : 0;
+
+    if (sscanf(line, ".include \"%80[^\"]\"", name) != 1) {
+        report_error(line_number, 1, "include", "expected .include \"FILE\"");
+        return;
+    }
+    if (name[0] == '/') dir_length = 0;
+    if (dir_length + strlen(name) >= FILENAME_MAX) {
+        report_error(line_number, 1, "include", "included file name too long");
+        return;
+    }
+    memcpy(path, from, dir_length);
+    strcpy(path + dir_length, name);
+    include_path(path, line_number, emit, context);
+}
+
+/* Records that the next lines of an intermediate file, as many as text holds, come from
+   source_line */
+void map_lines(LineMap *map, const char *text, int source_line) {
+    int *bigger;
+    int capacity;
+
+    for (; *text; text++) {
+        if (*text != '\n' && text[1]) continue;        /* a last line may lack its '\n' */
+        if (map->count == map->capacity) {
+            capacity = map->capacity ? map->capacity * 2 : 256;
+            bigger = realloc(map->lines, sizeof(int) * capacity);
+            if (!bigger) {
+                report_error(0, 0, "alloc", "memory allocation failed for the line map");
+                return;
+            }
+            map->lines    = bigger;
+            map->capacity = capacity;
+        }
+        map->lines[map->count++] = source_line;
+    }
+}
+
+/* The .pre file being written and the source line of each of its lines */
+typedef struct {
+    FILE *fp;
+    LineMap *lines;
+} PreOutput;
+
+/* Writes an included line to the .pre file, at the line of its .include */
+void write_included_line(const char *line, int line_number, void *context) {
+    PreOutput *out = (PreOutput *)context;
+    fputs(line, out->fp);
+    map_lines(out->lines, line, line_number);
+}
+
+/* ---- Macro libraries: a collected macro table saved by --build-macro-lib and mapped by
+   --macro-lib, so its macros are used with no parsing or compiling ---- */
+
+#define MACRO_LIB_MAGIC      "AMLB"
+#define MACRO_LIB_VERSION    1
+#define MACRO_LIB_BYTE_ORDER 0x01020304U    /* a library is only read on a host of its byte order */
+
+/* A library file is a header, then the hash buckets, the records, the compiled spans and
+   the names and contents. Every reference is an offset from the start of the file. */
+typedef struct {
+    char magic[4];
+    unsigned int version;
+    unsigned int byte_order;
+    unsigned int size;          /* of the whole file */
+    unsigned int macro_count;
+    unsigned int bucket_count;  /* a power of two */
+    unsigned int buckets;       /* bucket_count record numbers (index + 1), 0 for an empty bucket */
+    unsigned int records;       /* macro_count MacroLibRecord */
+} MacroLibHeader;
+
+typedef struct {
+    unsigned int hash;          /* hash_name of the name */
+    unsigned int next;          /* record number of the next macro in the bucket, 0 at the end */
+    unsigned int name;          /* NUL-terminated */
+    unsigned int content;       /* NUL-terminated */
+    unsigned int spans;         /* span_count MacroSpan, as compile_macro made them */
+    unsigned int span_count;
+    unsigned int param_count;
+} MacroLibRecord;
+
+const char *macro_lib = NULL;       /* the mapped --macro-lib file */
+size_t macro_lib_size = 0;
+
+/* Maps a macro library read-only; only the header and the bucket and record arrays are
+   checked here, a record is checked when a source first uses it */
+bool map_macro_library(const char *path) {
+    const MacroLibHeader *header;
+    struct stat info;
+    size_t size;
+    void *map;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Error: cannot open macro library %s\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size = (size_t)info.st_size;
+    map = size >= sizeof(MacroLibHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: %s is not a macro library\n", path);
+        return false;
+    }
+
+    header = (const MacroLibHeader *)map;
+    if (memcmp(header->magic, MACRO_LIB_MAGIC, 4) != 0 || header->byte_order != MACRO_LIB_BYTE_ORDER ||
+        header->version != MACRO_LIB_VERSION || header->size != size ||
+        header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0 ||
+        header->buckets % sizeof(unsigned int) != 0 || header->records % sizeof(unsigned int) != 0 ||
+        header->buckets > size || header->records > size ||
+        header->bucket_count > (size - header->buckets) / sizeof(unsigned int) ||
+        header->macro_count > (size - header->records) / sizeof(MacroLibRecord)) {
+        fprintf(stderr, "Error: %s is not a version %d macro library for this host\n", path, MACRO_LIB_VERSION);
+        munmap(map, size);
+        return false;
+    }
+    macro_lib      = (const char *)map;
+    macro_lib_size = size;
+    return true;
+}
+
+/* Checks that a record only refers to the inside of the mapped library */
+bool valid_lib_record(const MacroLibRecord *record) {
+    const MacroSpan *spans;
+    size_t content_length;
+    unsigned int i;
+
+    if (record->name >= macro_lib_size || record->content >= macro_lib_size ||
+        !memchr(macro_lib + record->name, '\0', macro_lib_size - record->name) ||
+        !memchr(macro_lib + record->content, '\0', macro_lib_size - record->content) ||
+        record->spans % sizeof(int) != 0 || record->spans > macro_lib_size ||
+        record->span_count > (macro_lib_size - record->spans) / sizeof(MacroSpan) ||
+        record->param_count > MAX_MACRO_PARAMS) {
+        return false;
+    }
+    content_length = strlen(macro_lib + record->content);
+    spans = (const MacroSpan *)(macro_lib + record->spans);
+    for (i = 0; i < record->span_count; i++) {
+        if (spans[i].param < 0 ? spans[i].start < 0 || spans[i].length < 0 ||
+                                 (size_t)spans[i].start + spans[i].length > content_length
+                               : spans[i].param >= (int)record->param_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Finds the macro called name (length characters) in the mapped library and adds a view of
+   it to the macro table: its name, content and spans stay in the mapping. Macros defined
+   by the source come first, so they hide library macros of the same name. */
+Macro *library_macro(const char *name, size_t length) {
+    const MacroLibHeader *header = (const MacroLibHeader *)macro_lib;
+    const unsigned int *buckets;
+    const MacroLibRecord *records, *record = NULL;
+    char key[MAX_LINE_LENGTH];
+    unsigned int number, steps = 0;
+    unsigned long h;
+    Macro *macro;
+
+    if (!macro_lib || length == 0 || length >= MAX_LINE_LENGTH) return NULL;
+    memcpy(key, name, length);
+    key[length] = '\0';
+    h = hash_name(key);
+
+    buckets = (const unsigned int *)(macro_lib + header->buckets);
+    records = (const MacroLibRecord *)(macro_lib + header->records);
+    for (number = buckets[h & (header->bucket_count - 1)]; number; number = record->next) {
+        if (number > header->macro_count || steps++ > header->macro_count) return NULL;
+        record = &records[number - 1];
+        if (record->hash == (unsigned int)h && record->name < macro_lib_size &&
+            strncmp(macro_lib + record->name, key, macro_lib_size - record->name) == 0) {
+            break;
+        }
+    }
+    if (!number) return NULL;
+    if (!valid_lib_record(record)) {
+        report_error(0, 0, "macro", "macro '%s' in the macro library is corrupt", key);
+        return NULL;
+    }
+
+    macro = (Macro *)malloc(sizeof(Macro));
+    if (!macro) {
+        report_error(0, 0, "alloc", "memory allocation failed for macro '%s'", key);
+        return NULL;
+    }
+    macro->name        = macro_lib + record->name;
+    macro->content     = macro_lib + record->content;
+    macro->param_count = (int)record->param_count;
+    macro->spans       = (const MacroSpan *)(macro_lib + record->spans);
+    macro->span_count  = (int)record->span_count;
+    macro->shared      = true;
+    macro->next        = macro_table;
+    macro_table        = macro;
+    return macro;
+}
+
+/* Writes the macro table to path as a macro library, in one write */
+bool write_macro_library(const char *path) {
+    MacroLibHeader header;
+    MacroLibRecord *records;
+    unsigned int *buckets;
+    const Macro *macro;
+    char *image;
+    size_t size, spans, strings, at;
+    unsigned int count = 0, i, slot;
+    FILE *fp;
+    bool ok;
+
+    for (macro = macro_table; macro; macro = macro->next) count++;
+    memcpy(header.magic, MACRO_LIB_MAGIC, 4);
+    header.version      = MACRO_LIB_VERSION;
+    header.byte_order   = MACRO_LIB_BYTE_ORDER;
+    header.macro_count  = count;
+    for (header.bucket_count = 1; header.bucket_count < 2 * count; header.bucket_count *= 2)
+        ;
+    header.buckets = sizeof(MacroLibHeader);
+    header.records = header.buckets + header.bucket_count * sizeof(unsigned int);
+    spans = strings = header.records + count * sizeof(MacroLibRecord);
+    for (macro = macro_table; macro; macro = macro->next) strings += macro->span_count * sizeof(MacroSpan);
+    size = strings;
+    for (macro = macro_table; macro; macro = macro->next) size += strlen(macro->name) + strlen(macro->content) + 2;
+    header.size = (unsigned int)size;
+
+    image = calloc(1, size);
+    if (!image) {
+        report_error(0, 0, "alloc", "memory allocation failed for macro library %s", path);
+        return false;
+    }
+    memcpy(image, &header, sizeof(header));
+    buckets = (unsigned int *)(image + header.buckets);
+    records = (MacroLibRecord *)(image + header.records);
+    for (macro = macro_table, i = 0; macro; macro = macro->next, i++) {
+        records[i].hash        = (unsigned int)hash_name(macro->name);
+        records[i].param_count = (unsigned int)macro->param_count;
+        records[i].span_count  = (unsigned int)macro->span_count;
+        records[i].spans       = (unsigned int)spans;
+        memcpy(image + spans, macro->spans, macro->span_count * sizeof(MacroSpan));
+        spans += macro->span_count * sizeof(MacroSpan);
+        records[i].name = (unsigned int)strings;
+        at = strlen(macro->name) + 1;
+        memcpy(image + strings, macro->name, at);
+        strings += at;
+        records[i].content = (unsigned int)strings;
+        at = strlen(macro->content) + 1;
+        memcpy(image + strings, macro->content, at);
+        strings += at;
+
+        slot = records[i].hash & (header.bucket_count - 1);
+        records[i].next = buckets[slot];
+        buckets[slot]   = i + 1;
+    }
+
+    fp = fopen(path, "wb");
+    ok = fp && fwrite(image, 1, size, fp) == size;
+    if (fp && fclose(fp) != 0) ok = false;
+    if (!ok) report_error(0, 0, "io", "cannot write macro library %s", path);
+    free(image);
+    return ok;
+}
+
+/* Ignores the lines of a file read for its macros only */
+void discard_line(const char *line, int line_number, void *context) {
+    (void)line;
+    (void)line_number;
+    (void)context;
+}
+
+/* --build-macro-lib: collects the macros defined (or included) by the sources and writes
+   them to out_filename. Returns false on errors, and then writes nothing. */
+bool build_macro_library(char *sources[], int count, const char *out_filename) {
+    int i;
+
+    reset_assembler_state();
+    begin_diagnostics(out_filename);
+    for (i = 0; i < count && !error_limit_reached(); i++) {
+        include_path(sources[i], 0, discard_line, NULL);
+    }
+    if (error_count == 0) write_macro_library(out_filename);
+    return finish_diagnostics();
+}
+
+/* Collects macro definitions (written to no file) and copies every other line to the .pre
+   file; line numbers are those of the source, and lines gets the one of each .pre line */
+void preprocess_file(const char *input_filename, const char *output_filename, LineMap *lines) {
+    FILE *input_fp = fopen(input_filename, "r");
+    FILE *output_fp = fopen(output_filename, "w");
+    PreOutput out;
+    char line[MAX_LINE_LENGTH];
+    char macro_name[MAX_LINE_LENGTH];
+    char macro_content[MAX_LINE_LENGTH * 10];
+    char params[MAX_MACRO_PARAMS][MAX_LINE_LENGTH];
+    int param_count = 0, line_number = 0;
+    bool in_macro = false;
+
+    lines->count = 0;
+    if (!input_fp || !output_fp) {
+        report_error(0, 0, "io", "failed to open %s or %s", input_filename, output_filename);
+        if (input_fp) fclose(input_fp);
+        if (output_fp) fclose(output_fp);
+        return;
+    }
+    out.fp    = output_fp;
+    out.lines = lines;
+
+    while (fgets(line, MAX_LINE_LENGTH, input_fp)) {
+        line_number++;
+
+        /* התחלת הגדרת מאקרו */
+        if (strncmp(line, "macro ", 6) == 0) {
+            if (in_macro) {
+                report_error(line_number, 1, "macro", "nested macro definitions not allowed");
+                break;
+            }
+            param_count = parse_macro_header(line, line_number, macro_name, params);
+            if (param_count >= 0 && macro_exists(macro_name)) {
+                report_error(line_number, 7, "macro", "duplicate macro '%s'", macro_name);
+                param_count = -1;
+            }
+            in_macro = true;
+            macro_content[0] = '\0';
+            continue;
+        }
+
+        /* סוף הגדרת מאקרו */
+        if (in_macro && strncmp(line, "endmacro", 8) == 0) {
+            in_macro = false;
+            if (param_count >= 0) add_macro(macro_name, macro_content, params, param_count);
+            continue;
+        }
+
+        if (!in_macro && strncmp(line, ".include ", 9) == 0) {
+            include_file(input_filename, line, line_number, write_included_line, &out);
+            continue;
+        }
+
+        if (in_macro) {
+            /* בתוך מאקרו – מצטבר לתוכן */
+            if (strlen(macro_content) + strlen(line) < sizeof(macro_content)) {
+                strcat(macro_content, line);
+            } else {
+                report_error(line_number, 1, "macro", "macro '%s' is too long", macro_name);
+            }
+        } else {
+            /* מחוץ למאקרו – כותב לשורה ב־.pre */
+            fprintf(output_fp, "%s", line);
+            map_lines(lines, line, line_number);
+        }
+    }
+
+    if (in_macro) {
+        report_error(0, 0, "macro", "missing endmacro for '%s'", macro_name);
+    }
+
+    fclose(input_fp);
+    fclose(output_fp);
+}
+
+/* Returns where the statement of a line starts, past leading spaces and a label */
+const char *skip_macro_label(const char *line) {
+    const char *p;
+
+    while (isspace((unsigned char)*line)) line++;
+    for (p = line; isalnum((unsigned char)*p); p++)
+        ;
+    if (*p == ':' && p > line) {
+        line = p + 1;
+        while (isspace((unsigned char)*line)) line++;
+    }
+    return line;
+}
+
+/* Returns the macro a line invokes, or NULL. The use may follow a label. */
+Macro *match_macro(const char *line) {
+    Macro *curr_macro;
+    const char *p;
+    size_t len;
+
+    line = skip_macro_label(line);
+
+    /* Try to match with a macro name */
+    for (curr_macro = macro_table; curr_macro != NULL; curr_macro = curr_macro->next) {
+        len = strlen(curr_macro->name);
+        if (strncmp(line, curr_macro->name, len) == 0 &&
+            (isspace((unsigned char)line[len]) || line[len] == '\0')) {
+            return curr_macro;
+        }
+    }
+    for (p = line; *p && !isspace((unsigned char)*p); p++)
+        ;
+    return library_macro(line, (size_t)(p - line));
+}
+
+/* If line uses a macro, writes its expansion (at most size bytes, with the label of the
+   use on its first line) to out and returns true. Expanding copies the spans of the
+   compiled body, taking each parameter slot from the arguments of the use. */
+bool expand_macro_line(const char *line, int line_number, char *out, size_t size) {
+    char args[MAX_MACRO_PARAMS][MAX_LINE_LENGTH];
+    const Macro *macro = match_macro(line);
+    const MacroSpan *span;
+    const char *text, *use;
+    size_t used = 0, length;
+    int count, i;
+
+    if (!macro) return false;
+    out[0] = '\0';
+
+    /* label of the use, if any: the name is matched right after it, a label may contain it */
+    while (isspace((unsigned char)*line)) line++;
+    use = skip_macro_label(line);
+    if (use > line) {
+        length = (size_t)(use - line);
+        if (length >= size) return true;
+        memcpy(out, line, length);
+        used = length;
+    }
+
+    count = split_macro_list(use + strlen(macro->name), args);
+    if (count != macro->param_count) {
+        report_error(line_number, 0, "macro", "macro '%s' takes %d argument(s)", macro->name, macro->param_count);
+        out[0] = '\0';
+        return true;
+    }
+
+    for (i = 0; i < macro->span_count; i++) {
+        span = &macro->spans[i];
+        if (span->param < 0) {
+            text   = macro->content + span->start;
+            length = (size_t)span->length;
+        } else {
+            text   = args[span->param];
+            length = strlen(text);
+        }
+        if (used + length >= size) {
+            report_error(line_number, 0, "macro", "expansion of macro '%s' is too long", macro->name);
+            out[0] = '\0';
+            return true;
+        }
+        memcpy(out + used, text, length);
+        used += length;
+    }
+    out[used] = '\0';
+    return true;
+}
+
+/* Writes the .am file: the .pre file with every macro use expanded. pre_lines holds the
+   source line of each .pre line, am_lines gets the one of each .am line. */
+void expand_macros(const char *input_filename, const char *output_filename,
+                   const LineMap *pre_lines, LineMap *am_lines) {
+    FILE *input_fp = fopen(input_filename, "r");
+    FILE *output_fp = fopen(output_filename, "w");
+    char line[MAX_LINE_LENGTH];
+    char expansion[MAX_LINE_LENGTH * 20];
+    int pre_line = 0, source_line;
+
+    am_lines->count = 0;
+    if (!input_fp || !output_fp) {
+        report_error(0, 0, "io", "failed to open %s or %s", input_filename, output_filename);
+        if (input_fp) fclose(input_fp);
+        if (output_fp) fclose(output_fp);
         return;
     }
 
-    /* .data directive */
-    if (strncmp(line_ptr, ".data", 5) == 0) {
-        line_ptr += 5;
-        while (isspace((unsigned char)*line_ptr)) line_ptr++;
+    while (fgets(line, MAX_LINE_LENGTH, input_fp)) {
+        pre_line++;
+        source_line = pre_line <= pre_lines->count ? pre_lines->lines[pre_line - 1] : 0;
+        if (expand_macro_line(line, source_line, expansion, sizeof(expansion))) {
+            fprintf(output_fp, "%s", expansion);
+            map_lines(am_lines, expansion, source_line);
+        } else {
+            fprintf(output_fp, "%s", line);  /* Not a macro, write as-is */
+            map_lines(am_lines, line, source_line);
+        }
+    }
+
+    fclose(input_fp);
+    fclose(output_fp);
+}
+
+
+/* Checks if a line starts with a label: a name right before a colon */
+bool is_label(const char *line) {
+    Statement st;
+    lex_line(line, &st);
+    return st.label >= 0;
+}
+
+
+/* Checks if the line contains a directive like .data or .string */
+bool is_directive(const char *line) {
+    Statement st;
+    lex_line(line, &st);
+    return st.kind == STATEMENT_DIRECTIVE;
+}
+
+
+/* Checks if the line contains a valid instruction */
+bool is_instruction(const char *line) {
+    Statement st;
+    lex_line(line, &st);
+    return st.kind == STATEMENT_INSTRUCTION;
+}
+
+
+/* Checks if the line is an .entry directive (a string or a label that holds ".entry" is not) */
+bool is_entry_line(const char *line) {
+    Statement st;
+    lex_line(line, &st);
+    return st.kind == STATEMENT_DIRECTIVE && token_is(line, &st.tokens[st.head], ".entry");
+}
+
+
+/* Detects addressing mode of an operand */
+int detect_addressing_mode(const char *operand) {
+    if (!operand) return -1; /* No operand */
+
+    /* Immediate addressing: starts with '#' */
+    if (operand[0] == '#') {
+        return ADDR_IMMEDIATE;
+    }
+
+    /* Register addressing: one of r0 .. r<REGISTER_COUNT-1> (e.g., r3) */
+    if (register_number(operand, (int)strlen(operand)) >= 0) {
+        return ADDR_REGISTER;
+    }
+
+    /* Index addressing: contains brackets like LABEL[r2] */
+    if (strchr(operand, '[') && strchr(operand, ']')) {
+        return ADDR_INDEX;
+    }
+
+    /* Otherwise it's direct addressing */
+    return ADDR_DIRECT;
+}
+
+
+/* Parses an instruction line and prints its parts */
+void parse_instruction(const char *line) {
+    Statement st;
+    char text[MAX_LINE_LENGTH];
+    int k;
+
+    lex_line(line, &st);
+    printf("==> Instruction parsed:\n");
+    if (st.head >= 0) {
+        token_text(line, &st.tokens[st.head], text);
+        printf("    Opcode: %s\n", text);
+    }
+
+    for (k = 0; k < st.operand_count && k < 2; k++) {
+        operand_text(line, &st, k, text);
+        printf("    Operand %d: %s\n", k + 1, text);
+        printf("    Addressing mode %d: %d\n", k + 1, detect_addressing_mode(text));
+    }
+}
+
+/* Encodes a lexed instruction into its primary machine word */
+int encode_statement(const char *line, const Statement *st) {
+    char name[MAX_LINE_LENGTH], operand[MAX_LINE_LENGTH];
+    const OpcodeInfo *info;
+    int opcode = 0;
+    int src_mode = 0, dst_mode = 0;
+
+    /* Translate opcode to number */
+    if (st->head >= 0) {
+        token_text(line, &st->tokens[st->head], name);
+        info = find_opcode(name);
+        if (info) opcode = info->code;
+    }
+
+    /* Set addressing modes: the first operand goes in the source bits, the second in the
+       destination bits */
+    if (st->operand_count >= 1) {
+        operand_text(line, st, 0, operand);
+        src_mode = detect_addressing_mode(operand);
+    }
+    if (st->operand_count >= 2) {
+        operand_text(line, st, 1, operand);
+        dst_mode = detect_addressing_mode(operand);
+    }
+
+    /* Build the instruction word: the opcode, src mode and dst mode fields of the ISA */
+    return isa_encode(opcode, src_mode, dst_mode);
+}
+
+/* Encodes a single assembly instruction into an integer machine word, Returns the encoded value as an int. */
+int encode_instruction(const char *line) {
+    Statement st;
+    lex_line(line, &st);
+    return encode_statement(line, &st);
+}
+
+
+/* Reserves words in the zero-fill segment; false (and reported) if they do not fit */
+bool reserve_zero_fill(long words, const char *directive, int line_number, int column) {
+    if (words < 0 || memory_counter + bss_size + words > MAX_MEMORY) {
+        report_error(line_number, column, "memory-overflow", "memory overflow in %s", directive);
+        return false;
+    }
+    bss_size += (int)words;
+    return true;
+}
+
+/* Parses .data/.string/.mat/.space/.zero/.extern; line_number and column locate line_ptr
+   for diagnostics */
+void parse_data_directive(const char *line_ptr, int line_number, int column) {
+    char buffer[MAX_LINE_LENGTH];
+    char *token;
+
+    /* Skip leading whitespace */
+    while (isspace((unsigned char)*line_ptr)) {
+        line_ptr++;
+        column++;
+    }
+
+    /* .extern directive */
+    if (strncmp(line_ptr, ".extern", 7) == 0) {
+        line_ptr += 7;
+        while (isspace((unsigned char)*line_ptr)) line_ptr++;
+
+        char label_name[MAX_LINE_LENGTH];
+        if (sscanf(line_ptr, "%s", label_name) != 1) {
+            report_error(line_number, column, "directive", "invalid .extern syntax");
+            return;
+        }
+
+        Symbol *new_sym = malloc(sizeof(Symbol));
+        if (!new_sym) {
+            report_error(line_number, column, "alloc", "memory allocation failed in .extern");
+            return;
+        }
+        new_sym->name        = intern_name(label_name);
+        new_sym->address     = 0;
+        new_sym->is_data     = false;
+        new_sym->is_external = true;
+        new_sym->is_entry    = false;
+        new_sym->is_bss      = false;
+        new_sym->next        = symbol_table_head;
+        symbol_table_head    = new_sym;
+        return;
+    }
+
+    /* .data directive */
+    if (strncmp(line_ptr, ".data", 5) == 0) {
+        line_ptr += 5;
+        while (isspace((unsigned char)*line_ptr)) line_ptr++;
+
+        strncpy(buffer, line_ptr, MAX_LINE_LENGTH);
+        buffer[MAX_LINE_LENGTH-1] = '\0';
+
+        token = strtok(buffer, ", \t\n");
+        while (token) {
+            if (memory_counter >= MAX_MEMORY) {
+                report_error(line_number, column, "memory-overflow", "memory overflow in .data");
+                return;
+            }
+            memory[memory_counter] = data_word(token, memory_counter, line_number, column);
+            memory_counter++;
+            token = strtok(NULL, ", \t\n");
+        }
+        return;
+    }
+
+    /* .string directive */
+    if (strncmp(line_ptr, ".string", 7) == 0) {
+        line_ptr += 7;
+        while (isspace((unsigned char)*line_ptr)) line_ptr++;
+
+        if (*line_ptr != '"') {
+            report_error(line_number, column, "directive", "invalid .string format");
+            return;
+        }
+        line_ptr++;  /* skip opening quote */
+
+        while (*line_ptr && *line_ptr != '"') {
+            if (memory_counter >= MAX_MEMORY) {
+                report_error(line_number, column, "memory-overflow", "memory overflow in .string");
+                return;
+            }
+            memory[memory_counter] = (Word)*line_ptr;
+            memory_counter++;
+            line_ptr++;
+        }
+        if (*line_ptr != '"') {
+            report_error(line_number, column, "directive", "missing closing quote in .string");
+            return;
+        }
+        /* add null terminator */
+        if (memory_counter >= MAX_MEMORY) {
+            report_error(line_number, column, "memory-overflow", "memory overflow in .string");
+            return;
+        }
+        memory[memory_counter] = 0;
+        memory_counter++;
+        return;
+    }
+
+    /* .mat directive */
+    if (strncmp(line_ptr, ".mat", 4) == 0) {
+        int rows, cols;
+        /* parse dimensions */
+        if (sscanf(line_ptr + 4, " [%d][%d]", &rows, &cols) != 2 || rows <= 0 || cols <= 0) {
+            report_error(line_number, column, "directive", "invalid .mat dimensions");
+            return;
+        }
+        /* move past the closing ']' */
+        char *p = strchr(line_ptr, ']');
+        if (!p || !(p = strchr(p + 1, ']'))) {
+            report_error(line_number, column, "directive", "malformed .mat directive");
+            return;
+        }
+        p++;  /* now at initializer list or end */
+
+        while (isspace((unsigned char)*p)) p++;
+
+        int total = rows * cols;
+        int init_count = 0;
+
+        /* without initializers the matrix is all zeros: it only takes room at load time */
+        if (!*p || *p == '\n') {
+            reserve_zero_fill(total, ".mat", line_number, column);
+            return;
+        }
+        strncpy(buffer, p, MAX_LINE_LENGTH);
+        buffer[MAX_LINE_LENGTH-1] = '\0';
+        token = strtok(buffer, ", \t\n");
+        while (token && init_count < total) {
+            if (memory_counter >= MAX_MEMORY) {
+                report_error(line_number, column, "memory-overflow", "memory overflow in .mat");
+                return;
+            }
+            memory[memory_counter] = data_word(token, memory_counter, line_number, column);
+            memory_counter++;
+            init_count++;
+            token = strtok(NULL, ", \t\n");
+        }
+        if (token) {
+            report_error(line_number, column, "directive", "too many initializers for .mat");
+            return;
+        }
+        /* zero-fill the rest of a partly initialized matrix */
+        while (init_count < total) {
+            if (memory_counter >= MAX_MEMORY) {
+                report_error(line_number, column, "memory-overflow", "memory overflow in .mat");
+                return;
+            }
+            memory[memory_counter] = 0;
+            memory_counter++;
+            init_count++;
+        }
+        return;
+    }
+
+    /* .space N and .zero N: N zero words in the zero-fill segment */
+    if (strncmp(line_ptr, ".space", 6) == 0 || strncmp(line_ptr, ".zero", 5) == 0) {
+        const char *directive = line_ptr[1] == 's' ? ".space" : ".zero";
+        char error[ERROR_LENGTH];
+        long words;
+
+        line_ptr += strlen(directive);
+        while (isspace((unsigned char)*line_ptr)) line_ptr++;
+        strncpy(buffer, line_ptr, MAX_LINE_LENGTH);
+        buffer[MAX_LINE_LENGTH-1] = '\0';
+        buffer[strcspn(buffer, "\n")] = '\0';
+
+        if (!buffer[0] || !is_constant_expression(buffer)) {
+            report_error(line_number, column, "directive", "%s needs a constant size", directive);
+        } else if (!evaluate_expression(buffer, &words, error)) {
+            report_error(line_number, column, "expression", "%s", error);
+        } else if (words <= 0) {
+            report_error(line_number, column, "directive", "invalid %s size %ld", directive, words);
+        } else {
+            reserve_zero_fill(words, directive, line_number, column);
+        }
+        return;
+    }
+
+    /* .entry is handled by mark_entries */
+    if (strncmp(line_ptr, ".entry", 6) == 0) {
+        return;
+    }
+
+    /* unknown directive */
+    report_error(line_number, column, "directive", "unrecognized directive");
+}
+
+
+/* Pool of data blocks already placed in memory[], keyed by a hash of their values */
+#define DATA_POOL_BUCKETS 256
+
+typedef struct DataBlock {
+    int address;        /* first word of the block */
+    int length;         /* number of words */
+    unsigned long hash;
+    struct DataBlock *next;
+} DataBlock;
+
+DataBlock *data_pool[DATA_POOL_BUCKETS];
+int pooled_words = 0;   /* data words saved by sharing blocks */
+
+/* The last data block, if its label was aliased to an earlier copy: an unlabeled block right
+   after it continues it, and then it needs its own copy back */
+Symbol *pooled_tail = NULL;
+int pooled_tail_length = 0;
+
+/* Frees every pooled block, called once per source file */
+void clear_data_pool(void) {
+    DataBlock *cur, *next;
+    int i;
+    for (i = 0; i < DATA_POOL_BUCKETS; i++) {
+        for (cur = data_pool[i]; cur; cur = next) {
+            next = cur->next;
+            free(cur);
+        }
+        data_pool[i] = NULL;
+    }
+    pooled_words = 0;
+    pooled_tail  = NULL;
+}
+
+/* FNV-1a over the values of memory[start .. start+length) */
+unsigned long hash_data_block(int start, int length) {
+    unsigned long h = 2166136261UL;
+    int i;
+    for (i = start; i < start + length; i++) {
+        h ^= (unsigned long)(memory[i] & 0xFFFF);
+        h *= 16777619UL;
+        h &= 0xFFFFFFFFUL;
+    }
+    return h;
+}
+
+/* Looks for an earlier block with the same values as the one just written at start.
+   Returns the address the block should be referenced by: the earlier copy if there is one,
+   otherwise start itself (and the block is added to the pool). */
+int pool_data_block(int start, int length) {
+    unsigned long h = hash_data_block(start, length);
+    DataBlock *cur = data_pool[h % DATA_POOL_BUCKETS];
+    DataBlock *new_block;
+    int i;
+
+    for (; cur; cur = cur->next) {
+        if (cur->hash != h || cur->length != length) continue;
+        for (i = 0; i < length; i++) {
+            if (memory[cur->address + i] != memory[start + i]) break;
+        }
+        if (i == length) {
+            return cur->address;
+        }
+    }
+
+    new_block = malloc(sizeof(DataBlock));
+    if (!new_block) {
+        report_error(0, 0, "alloc", "memory allocation failed for data pool");
+        return start;
+    }
+    new_block->address = start;
+    new_block->length  = length;
+    new_block->hash    = h;
+    new_block->next    = data_pool[h % DATA_POOL_BUCKETS];
+    data_pool[h % DATA_POOL_BUCKETS] = new_block;
+    return start;
+}
+
+
+/* Puts the pooled tail block back in front of the unlabeled block just written at start,
+   since fixups were added for the words of that block */
+void unpool_tail_block(int start, Fixup *since) {
+    Fixup *fixup;
+    int length = pooled_tail_length;
+
+    if (memory_counter + length > MAX_MEMORY) {
+        report_error(0, 0, "memory-overflow", "memory overflow in data block");
+        return;
+    }
+    memmove(&memory[start + length], &memory[start], sizeof(Word) * (memory_counter - start));
+    memcpy(&memory[start], &memory[pooled_tail->address], sizeof(Word) * length);
+    for (fixup = fixup_head; fixup != since; fixup = fixup->next) {
+        fixup->address += length;
+    }
+    pooled_tail->address = start;
+    memory_counter += length;
+    pooled_words   -= length;
+}
+
+
+/* What the first pass needs to know about a line before it touches the tables. Working
+   this out only reads the line, so the parallel first pass does it on many threads. */
+typedef struct {
+    bool skip;              /* empty or comment */
+    int start;              /* offset of the first non-space character */
+    int body;               /* offset of the statement, past the label */
+    bool label, directive, instruction;
+    bool valid;             /* an instruction that passed check_instruction */
+    Word word;              /* the encoded first word of a valid instruction */
+} LineClass;
+
+void classify_line(const char *line, int line_number, LineClass *info) {
+    const char *line_ptr;
+    Statement st;
+
+    info->skip = line[0] == '\n' || line[0] == ';';
+    if (info->skip) return;
+
+    /* Trim leading whitespace */
+    line_ptr = line;
+    while (isspace((unsigned char)*line_ptr)) {
+        line_ptr++;
+    }
+    info->start = (int)(line_ptr - line);
+
+    lex_line(line, &st);
+    info->label       = st.label >= 0;
+    info->directive   = st.kind == STATEMENT_DIRECTIVE;
+    info->instruction = st.kind == STATEMENT_INSTRUCTION;
+
+    /* advance pointer past label */
+    if (info->label) {
+        line_ptr = line + st.tokens[1].start + 1;
+        while (isspace((unsigned char)*line_ptr)) {
+            line_ptr++;
+        }
+    }
+    info->body = (int)(line_ptr - line);
+
+    /* validate operand count and addressing modes, encode the primary word */
+    info->valid = false;
+    info->word  = 0;
+    if (info->instruction) {
+        info->valid = check_statement(line, &st, line_number, 1, false);
+        if (info->valid) info->word = (Word)encode_statement(line, &st);
+    }
+}
+
+/* Enters a classified line into the symbol table, the instruction list and memory */
+void enter_line(const char *line, int line_number, const LineClass *info) {
+    Symbol *new_sym = NULL;
+    InstructionNode *new_instr;
+    char label_name[MAX_LINE_LENGTH];
+    const char *line_ptr = line + info->body;
+
+    if (info->skip) return;
+
+    /* Handle label definition */
+    if (info->label) {
+        /* extract label name */
+        sscanf(line + info->start, "%[^:]:", label_name);
+
+        new_sym = malloc(sizeof(Symbol));
+        if (!new_sym) {
+            report_error(line_number, 0, "alloc", "memory allocation failed for symbol");
+            return;
+        }
+        new_sym->name         = intern_name(label_name);
+        new_sym->address      = memory_counter;
+        new_sym->is_entry     = false;
+        new_sym->is_external  = false;
+        new_sym->is_data      = info->directive;
+        new_sym->is_bss       = false;
+        new_sym->next         = symbol_table_head;
+        symbol_table_head     = new_sym;
+    }
+
+    /* Handle directive (.data/.string/.extern/.entry/.mat/.space/.zero) */
+    if (info->directive) {
+        int block_start = memory_counter;
+        int bss_start = bss_size;
+        Fixup *fixups = fixup_head;
+        parse_data_directive(line_ptr, line_number, info->body + 1);
+
+        /* a reservation in the zero-fill segment: the label is placed with the segment */
+        if (bss_size != bss_start && new_sym) {
+            new_sym->is_bss  = true;
+            new_sym->address = bss_start;
+        }
+
+        /* identical block already in memory: drop this copy and alias the label to it.
+           Only a block with its own label is shared, an unlabeled one continues the block
+           before it. Blocks with label expressions are not final yet and are never shared. */
+        if (opt_pool_data && memory_counter > block_start) {
+            if (!new_sym) {
+                if (pooled_tail) unpool_tail_block(block_start, fixups);
+                pooled_tail = NULL;
+            } else {
+                int shared = fixup_head == fixups ?
+                             pool_data_block(block_start, memory_counter - block_start) : block_start;
+                pooled_tail = NULL;
+                if (shared != block_start) {
+                    pooled_tail        = new_sym;
+                    pooled_tail_length = memory_counter - block_start;
+                    pooled_words      += pooled_tail_length;
+                    memory_counter     = block_start;
+                    new_sym->address   = shared;
+                }
+            }
+        }
+    }
+    /* Handle instruction */
+    else if (info->instruction) {
+        /* report why it failed validation */
+        if (!info->valid) {
+            validate_instruction(line_ptr, line_number, info->body + 1);
+            return;
+        }
+
+        /* create new instruction node */
+        new_instr = malloc(sizeof(InstructionNode));
+        if (!new_instr) {
+            report_error(line_number, 0, "alloc", "memory allocation failed for instruction node");
+            return;
+        }
+        new_instr->address = memory_counter;
+        new_instr->line_number = line_number;
+        new_instr->line = intern_line(line_ptr);
+        new_instr->next = NULL;
+
+        /* append to instruction list */
+        if (instruction_head == NULL) {
+            instruction_head = new_instr;
+            instruction_tail = new_instr;
+        } else {
+            instruction_tail->next = new_instr;
+            instruction_tail = new_instr;
+        }
+
+        /* store primary instruction word */
+        if (memory_counter < MAX_MEMORY) {
+            memory[memory_counter] = info->word;
+        } else {
+            report_error(line_number, info->body + 1, "memory-overflow",
+                         "memory overflow when adding instruction");
+        }
+        memory_counter++;
+    }
+    /* Unknown or invalid line */
+    else {
+        report_error(line_number, info->body + 1, "unrecognized-statement", "unrecognized statement");
+    }
+}
+
+/* First pass over one .am line: adds its label to the symbol table, places its data words,
+   and records an instruction with its primary word */
+void first_pass_line(char *line, int line_number) {
+    LineClass info;
+    classify_line(line, line_number, &info);
+    enter_line(line, line_number, &info);
+}
+
+/* With an explicit --jobs=N, sources with at least this many statements are classified by
+   N threads, in chunks of statements. Every statement takes at least one of the MAX_MEMORY
+   words or is an .extern/.entry, so real sources stay well under a thousand statements;
+   blank and comment lines are not counted. */
+#define PARALLEL_PASS_STATEMENTS 256
+#define PASS_CHUNK_STATEMENTS    64
+
+/* The lines of a source shared by the threads of the parallel first pass */
+typedef struct {
+    char (*lines)[MAX_LINE_LENGTH];
+    LineClass *classes;
+    int *statements;        /* line indexes of the lines that are not blank or comments */
+    int statement_count;
+    int next_chunk;         /* next chunk a thread takes, under lock */
+    pthread_mutex_t lock;
+} PassWork;
+
+void *pass_worker(void *arg) {
+    PassWork *work = (PassWork *)arg;
+    int chunk, i, end, line;
+
+    for (;;) {
+        pthread_mutex_lock(&work->lock);
+        chunk = work->next_chunk++;
+        pthread_mutex_unlock(&work->lock);
+        if (chunk * PASS_CHUNK_STATEMENTS >= work->statement_count) break;
+
+        end = (chunk + 1) * PASS_CHUNK_STATEMENTS;
+        if (end > work->statement_count) end = work->statement_count;
+        for (i = chunk * PASS_CHUNK_STATEMENTS; i < end; i++) {
+            line = work->statements[i];
+            classify_line(work->lines[line], line + 1, &work->classes[line]);
+        }
+    }
+    return NULL;
+}
+
+/* First pass over a large source: threads classify, validate and encode chunks of
+   statements, then the lines are entered in source order, so addresses, tables and
+   diagnostics are those of the serial pass. Returns false when the source has too few
+   statements or memory is short, the caller then runs the serial pass from the top. */
+bool parallel_first_pass(FILE *fp) {
+    pthread_t threads[MAX_LINK_JOBS];
+    PassWork work;
+    char (*bigger)[MAX_LINE_LENGTH];
+    int size = 1024, count = 0, i, started = 0, jobs = opt_jobs;
+
+    work.lines = malloc(sizeof(*work.lines) * size);
+    while (work.lines && fgets(work.lines[count], MAX_LINE_LENGTH, fp)) {
+        if (++count == size) {
+            size *= 2;
+            bigger = realloc(work.lines, sizeof(*work.lines) * size);
+            if (!bigger) free(work.lines);
+            work.lines = bigger;
+        }
+    }
+    work.classes    = work.lines ? malloc(sizeof(LineClass) * (count + 1)) : NULL;
+    work.statements = work.classes ? malloc(sizeof(int) * (count + 1)) : NULL;
+    work.statement_count = 0;
+    for (i = 0; work.statements && i < count; i++) {
+        if (work.lines[i][0] == '\n' || work.lines[i][0] == ';') {
+            work.classes[i].skip = true;        /* what classify_line says of them */
+        } else {
+            work.statements[work.statement_count++] = i;
+        }
+    }
+    if (!work.statements || work.statement_count < PARALLEL_PASS_STATEMENTS) {
+        free(work.statements);
+        free(work.classes);
+        free(work.lines);
+        rewind(fp);
+        return false;
+    }
+
+    work.next_chunk = 0;
+    pthread_mutex_init(&work.lock, NULL);
+    if (jobs > MAX_LINK_JOBS) jobs = MAX_LINK_JOBS;
+    for (i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[started], NULL, pass_worker, &work) != 0) break;
+        started++;
+    }
+    pass_worker(&work);     /* the calling thread helps too */
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&work.lock);
+
+    for (i = 0; i < count && !error_limit_reached(); i++) {
+        enter_line(work.lines[i], i + 1, &work.classes[i]);
+    }
+    free(work.statements);
+    free(work.classes);
+    free(work.lines);
+    return true;
+}
+
+/* Builds the symbol table, the data words and the primary instruction words;
+   stops early once --max-errors is reached */
+void first_pass(FILE *fp) {
+    char line[MAX_LINE_LENGTH];
+    int line_number = 0;
+
+    rewind(fp);
+    clear_data_pool();
+
+    if (opt_parallel_pass && opt_jobs > 1 && parallel_first_pass(fp)) return;
+    while (!error_limit_reached() && fgets(line, MAX_LINE_LENGTH, fp)) {
+        first_pass_line(line, ++line_number);
+    }
+}
+
+/* Splits an index operand LABEL[rN] into its label and register number */
+void parse_index_operand(const char *operand, char *label, int *reg) {
+    *reg = 0;
+    label[0] = '\0';
+    sscanf(operand, "%[^[][%*c%d%*c]", label, reg);
+}
+
+/* Returns how many memory words an instruction occupies once its operand words are added */
+int instruction_length(const char *line) {
+    char texts[2][MAX_LINE_LENGTH];
+    char *ops[2];
+    int k, mode, length = 1;
+    int count = instruction_operands(line, texts);
+
+    ops[0] = count > 0 ? texts[0] : NULL;
+    ops[1] = count > 1 ? texts[1] : NULL;
+
+    /* registers of two register/index operands share a single word */
+    if (ops[0] && ops[1] &&
+        HOLDS_REGISTER(detect_addressing_mode(ops[0])) && HOLDS_REGISTER(detect_addressing_mode(ops[1]))) {
+        length++;
+        for (k = 0; k < 2; k++) {
+            if (detect_addressing_mode(ops[k]) == ADDR_INDEX) length++;   /* base word */
+        }
+        return length;
+    }
+    for (k = 0; k < 2; k++) {
+        if (!ops[k]) continue;
+        mode = detect_addressing_mode(ops[k]);
+        length += (mode == ADDR_INDEX) ? 2 : 1;     /* index = base word + register word */
+    }
+    return length;
+}
+
+/* Checks if a code label lands on the instruction at the given (first pass) address, the
+   one after is the address of the instruction before it. A label whose instruction was
+   removed stays behind and lands on the next instruction, see generate_extra_operand_words */
+bool code_label_between(int after, int address) {
+    Symbol *sym;
+    for (sym = symbol_table_head; sym; sym = sym->next) {
+        if (!sym->is_external && !sym->is_data && !sym->is_bss &&
+            sym->address > after && sym->address <= address) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Unlinks an instruction and closes the gap its primary word leaves in memory[] */
+void remove_instruction(InstructionNode *prev, InstructionNode *node) {
+    InstructionNode *cur;
+    Symbol *sym;
+    Fixup *fixup;
+    int addr = node->address;
+
+    /* move every later word one slot down */
+    memmove(&memory[addr], &memory[addr + 1], sizeof(Word) * (memory_counter - 1 - addr));
+    memory_counter--;
+
+    /* everything placed after the removed word moves with it; labels on the removed
+       instruction stay at addr and so land on the next instruction */
+    for (cur = node->next; cur; cur = cur->next) {
+        cur->address--;
+    }
+    for (sym = symbol_table_head; sym; sym = sym->next) {
+        if (!sym->is_external && !sym->is_bss && sym->address > addr) {
+            sym->address--;
+        }
+    }
+    for (fixup = fixup_head; fixup; fixup = fixup->next) {
+        if (fixup->address > addr) {
+            fixup->address--;
+        }
+    }
+
+    if (prev) prev->next = node->next;
+    else instruction_head = node->next;
+    if (instruction_tail == node) instruction_tail = prev;
+    free(node);
+}
+
+/* Peephole pass: drops instructions that have no effect, returns the number of code words saved.
+   Patterns:
+     mov rX, rX           -> removed
+     add #0, X / sub #0, X -> removed
+     jmp L (L is the next instruction) -> removed
+     inc X followed by dec X (or the reverse) -> both removed, unless the second one is labeled */
+int peephole_optimize(void) {
+    InstructionNode *prev, *cur, *next;
+    const OpcodeInfo *info, *next_info;
+    char ops[2][MAX_LINE_LENGTH], next_ops[2][MAX_LINE_LENGTH];
+    char *op1, *op2, *next_op;
+    char error[ERROR_LENGTH];
+    int count;
+    Symbol *sym;
+    long value;
+    int saved = 0;
+    bool changed = true;
+
+    /* removing a pair can bring two new instructions together, so repeat until stable */
+    while (changed) {
+        changed = false;
+        prev = NULL;
+        cur  = instruction_head;
+        while (cur) {
+            bool drop = false;
+            next = cur->next;
+
+            count = instruction_operands(cur->line, ops);
+            op1  = count > 0 ? ops[0] : NULL;
+            op2  = count > 1 ? ops[1] : NULL;
+            info = instruction_opcode(cur->line);
+
+            if (info) {
+                switch (info->code) {
+                case OP_MOV:
+                    drop = op1 && op2 &&
+                           detect_addressing_mode(op1) == ADDR_REGISTER && strcmp(op1, op2) == 0;
+                    break;
+                case OP_ADD:
+                case OP_SUB:
+                    drop = op1 && op1[0] == '#' && is_constant_expression(op1 + 1) &&
+                           evaluate_expression(op1 + 1, &value, error) && value == 0;
+                    break;
+                case OP_JMP:
+                    if (op1 && next && detect_addressing_mode(op1) == ADDR_DIRECT) {
+                        sym = find_symbol(op1);
+                        drop = sym && !sym->is_external && !sym->is_data && !sym->is_bss &&
+                               sym->address > cur->address && sym->address <= next->address;
+                    }
+                    break;
+                case OP_INC:
+                case OP_DEC:
+                    if (!op1 || !next || code_label_between(cur->address, next->address)) break;
+                    next_op   = instruction_operands(next->line, next_ops) > 0 ? next_ops[0] : NULL;
+                    next_info = instruction_opcode(next->line);
+                    if (next_info && next_op && next_info->code == (info->code == OP_INC ? OP_DEC : OP_INC) &&
+                        strcmp(op1, next_op) == 0) {
+                        /* drop the second one here, the first one below */
+                        saved += instruction_length(next->line);
+                        remove_instruction(cur, next);
+                        next = cur->next;
+                        drop = true;
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            if (drop) {
+                saved += instruction_length(cur->line);
+                remove_instruction(prev, cur);
+                changed = true;
+            } else {
+                prev = cur;
+            }
+            cur = next;
+        }
+    }
+    return saved;
+}
+
+/* Records that the operand word at address refers to an external label */
+void add_external_use(NameId name, int address) {
+    ExternalUse *use = malloc(sizeof(ExternalUse));
+    if (!use) {
+        report_error(0, 0, "alloc", "memory allocation failed for external use");
+        return;
+    }
+    use->name    = name;
+    use->address = address;
+    use->next    = NULL;
+
+    /* keep the list in address order; uses normally arrive in order, so try the tail first */
+    if (external_use_head == NULL) {
+        external_use_head = external_use_tail = use;
+    } else if (external_use_tail->address <= address) {
+        external_use_tail->next = use;
+        external_use_tail = use;
+    } else if (address < external_use_head->address) {
+        use->next = external_use_head;
+        external_use_head = use;
+    } else {
+        ExternalUse *prev = external_use_head;
+        while (prev->next->address <= address) prev = prev->next;
+        use->next  = prev->next;
+        prev->next = use;
+    }
+}
+
+/* Records that the operand word at address holds the address of sym */
+void add_fixup(Symbol *sym, int address) {
+    Fixup *fixup = malloc(sizeof(Fixup));
+    if (!fixup) {
+        report_error(0, 0, "alloc", "memory allocation failed for fixup");
+        return;
+    }
+    memset(fixup, 0, sizeof(*fixup));
+    fixup->address     = address;
+    fixup->symbol      = sym;
+    fixup->expr        = NULL;
+    fixup->line_number = 0;
+    fixup->linear      = true;
+    fixup->next        = fixup_head;
+    fixup_head         = fixup;
+}
+
+/* Drops the fixups recorded for operand words in [from, to) */
+void remove_fixups(int from, int to) {
+    Fixup **link = &fixup_head;
+    Fixup *fixup;
+
+    while ((fixup = *link) != NULL) {
+        if (fixup->address >= from && fixup->address < to) {
+            *link = fixup->next;
+            free(fixup);
+        } else {
+            link = &fixup->next;
+        }
+    }
+}
+
+/* Drops the external uses recorded for operand words in [from, to) */
+void remove_external_uses(int from, int to) {
+    ExternalUse **link = &external_use_head;
+    ExternalUse *use;
+
+    external_use_tail = NULL;
+    while ((use = *link) != NULL) {
+        if (use->address >= from && use->address < to) {
+            *link = use->next;
+            free(use);
+        } else {
+            external_use_tail = use;
+            link = &use->next;
+        }
+    }
+}
+
+/* Value of the operand word at address for text: an immediate, a direct label or an index
+   base. A plain label records its external use or fixup; an expression is folded if it is
+   constant, otherwise it is left to resolve_expressions. */
+Word operand_word(const char *text, bool immediate, int address, int line_number) {
+    char error[ERROR_LENGTH];
+    Symbol *sym;
+    long value = 0;
+
+    if (!immediate && is_label_name(text)) {
+        sym = find_symbol(text);
+        if (sym && sym->is_external) add_external_use(sym->name, address);
+        else if (sym) add_fixup(sym, address);
+        return (Word)(sym ? sym->address : 0);
+    }
+    if (!is_constant_expression(text)) {
+        add_expression_fixup(text, address, line_number);
+    } else if (!evaluate_expression(text, &value, error)) {
+        report_error(line_number, 0, "expression", "%s", error);
+    }
+    return (Word)value;
+}
+
+/* Writes the operand words of an instruction line starting at address (right after its
+   first word), records external uses and fixups, and returns the address after the last one */
+int emit_operand_words(const char *line, int address, int line_number) {
+    char texts[2][MAX_LINE_LENGTH];
+    char *ops[2];
+    int k, modes[2], regs[2], val;
+    int next = address;
+    int count = instruction_operands(line, texts);
+
+    ops[0]   = count > 0 ? texts[0] : NULL;
+    ops[1]   = count > 1 ? texts[1] : NULL;
+    modes[0] = ops[0] ? detect_addressing_mode(ops[0]) : -1;
+    modes[1] = ops[1] ? detect_addressing_mode(ops[1]) : -1;
+
+    /* if both operands hold a register (register or index mode), the index base
+       words come first and both registers share one word, the src register above the dst one */
+    if (HOLDS_REGISTER(modes[0]) && HOLDS_REGISTER(modes[1])) {
+        for (k = 0; k < 2; k++) {
+            if (modes[k] == ADDR_INDEX) {
+                char lbl[MAX_LINE_LENGTH];
+                parse_index_operand(ops[k], lbl, &regs[k]);
+                memory[next] = operand_word(lbl, false, next, line_number);
+                next++;
+            } else {
+                regs[k] = register_number(ops[k], (int)strlen(ops[k]));
+            }
+        }
+        memory[next] = (Word)((regs[0] << REGISTER_BITS) | regs[1]);
+        next++;
+        if (modes[0] == ADDR_INDEX || modes[1] == ADDR_INDEX) {
+            packed_words++;
+        }
+    } else {
+        /* otherwise generate one word per operand */
+        for (k = 0; k < 2; k++) {
+            if (modes[k] < 0) continue;
+            if (modes[k] == ADDR_IMMEDIATE) {
+                val = operand_word(ops[k] + 1, true, next, line_number);
+            } else if (modes[k] == ADDR_DIRECT) {
+                val = operand_word(ops[k], false, next, line_number);
+            } else if (modes[k] == ADDR_INDEX) {
+                char lbl[MAX_LINE_LENGTH];
+                int reg;
+                parse_index_operand(ops[k], lbl, &reg);
+                /* write base address word */
+                memory[next] = operand_word(lbl, false, next, line_number);
+                next++;
+                val = reg;
+            } else {                       /* single register */
+                val = register_number(ops[k], (int)strlen(ops[k]));
+            }
+            memory[next] = (Word)val;
+            next++;
+        }
+    }
+    return next;
+}
+
+void generate_extra_operand_words(void) {
+    InstructionNode *cur;
+    Symbol *sym;
+    Fixup *fixup;
+    Word temp[MAX_MEMORY];
+    int new_address[MAX_MEMORY + 1];
+    int code_address[MAX_MEMORY + 1];
+    int i, new_cnt, code_end;
+
+    if (memory_counter > MAX_MEMORY) {
+        report_error(0, 0, "memory-overflow", "memory overflow, image not generated");
+        return;
+    }
+
+    /* 1) Lay out the final image: each instruction followed by its operand words, then
+          the data words. new_address[] maps a first pass address to its final address */
+    packed_words = 0;
+    new_cnt = 100;
+    for (cur = instruction_head; cur; cur = cur->next) {
+        new_address[cur->address] = new_cnt;
+        new_cnt += instruction_length(cur->line);
+    }
+    code_end = new_cnt;
+    /* every word that is not an instruction's first word is data; the list is in address order */
+    cur = instruction_head;
+    for (i = 100; i < memory_counter; i++) {
+        if (cur && cur->address == i) {
+            cur = cur->next;
+        } else {
+            new_address[i] = new_cnt++;
+        }
+    }
+    new_address[memory_counter] = new_cnt;   /* labels after the last statement */
+    if (new_cnt + bss_size > MAX_MEMORY) {
+        report_error(0, 0, "memory-overflow", "memory overflow when adding operand words (%d words)",
+                     new_cnt + bss_size - 100);
+        return;
+    }
+
+    /* a code label goes to the first instruction at or after it: the peephole pass leaves
+       the labels of a removed instruction where it was, maybe on a data word now */
+    cur = instruction_head;
+    for (i = 100; i <= memory_counter; i++) {
+        while (cur && cur->address < i) cur = cur->next;
+        code_address[i] = cur ? new_address[cur->address] : code_end;
+    }
+
+    /* 2) Move code and data symbols to their final addresses, and zero-fill symbols to
+       theirs after the data */
+    for (sym = symbol_table_head; sym; sym = sym->next) {
+        if (sym->is_bss) {
+            sym->address += new_cnt;
+        } else if (!sym->is_external && sym->address >= 100 && sym->address <= memory_counter) {
+            sym->address = sym->is_data ? new_address[sym->address] : code_address[sym->address];
+        }
+    }
+    /* the only fixups so far are .data expressions, move them with their words */
+    for (fixup = fixup_head; fixup; fixup = fixup->next) {
+        fixup->address = new_address[fixup->address];
+    }
+
+    /* 3) Backup old memory */
+    memcpy(temp, memory, sizeof(memory));
+
+    /* 4) Rebuild code words with extra operand words */
+    new_cnt = 100;
+    cur     = instruction_head;
+    while (cur) {
+        /* copy primary instruction word */
+        memory[new_cnt++] = temp[cur->address];
+
+        new_cnt = emit_operand_words(cur->line, new_cnt, cur->line_number);
+        cur->length  = instruction_length(cur->line);
+        cur->address = new_cnt - cur->length;
+        cur = cur->next;
+    }
+
+    data_start = new_cnt;
+
+    /* 5) Append data words after code; new_address[] already placed them there */
+    for (i = 100; i < memory_counter; i++) {
+        if (new_address[i] >= data_start) {
+            memory[new_address[i]] = temp[i];
+        }
+    }
+    new_cnt = new_address[memory_counter];
+
+    /* 6) Update counter, then evaluate the expressions that use labels */
+    memory_counter = new_cnt;
+    resolve_expressions();
+}
+
+
+
+/* Marks the label of a .entry line as an entry */
+void mark_entry_line(const char *line, int line_number) {
+    const char *line_ptr;
+    const Token *head;
+    Statement st;
+
+    /* Skip empty lines or comment lines */
+    if (line[0] == '\n' || line[0] == ';') {
+        return;
+    }
+
+    /* Check if the line is a .entry directive, maybe after a label */
+    lex_line(line, &st);
+    head = st.head >= 0 ? &st.tokens[st.head] : NULL;
+    if (st.kind == STATEMENT_DIRECTIVE && token_is(line, head, ".entry")) {
+        char label_name[MAX_LINE_LENGTH];
+        Symbol *curr = symbol_table_head;
+        NameId name;
+        bool found = false;
+
+        /* Move pointer past the ".entry" part */
+        line_ptr = line + head->start + head->length;
+
+        /* Skip spaces before the label name */
+        while (isspace(*line_ptr)) {
+            line_ptr++;
+        }
+
+        /* Get the label name */
+        sscanf(line_ptr, "%s", label_name);
+
+        /* Go through the symbol table and search for that label */
+        name = lookup_name(label_name);
+        while (curr != NULL && name != NO_NAME) {
+            if (curr->name == name) {
+                curr->is_entry = 1;  /* Mark this symbol as entry */
+                found = true;
+                break;
+            }
+            curr = curr->next;
+        }
+
+        /* If not found, print error message */
+        if (!found) {
+            report_error(line_number, (int)(line_ptr - line) + 1, "undefined-entry",
+                         "entry label '%s' not found in symbol table", label_name);
+        }
+    }
+}
+
+/* Goes over the file again and handles .entry lines */
+void mark_entries(FILE *fp) {
+    char line[MAX_LINE_LENGTH];
+    int line_number = 0;
+
+    rewind(fp);  /* Start reading the file from the beginning */
+
+    while (fgets(line, MAX_LINE_LENGTH, fp)) {
+        mark_entry_line(line, ++line_number);
+    }
+}
+
+/* Writes one "NAME address" line per entry label */
+void write_entries(FILE *out) {
+    Symbol *curr;
+    for (curr = symbol_table_head; curr != NULL; curr = curr->next) {
+        if (curr->is_entry) {
+            fprintf(out, "%s %03d\n", name_text(curr->name), curr->address);
+        }
+    }
+}
+
+/* Writes one "NAME address" line per operand word that holds an external address */
+void write_externals(FILE *out) {
+    ExternalUse *use;
+    for (use = external_use_head; use; use = use->next) {
+        fprintf(out, "%s %d\n", name_text(use->name), use->address);
+    }
+}
+
+/* Creates the .ent file and writes all entry labels */
+void create_entry_file(const char *original_filename) {
+    FILE *ent_fp;
+    char ent_filename[FILENAME_MAX];
+
+    /* Create new filename by replacing .as with .ent */
+    strncpy(ent_filename, original_filename, FILENAME_MAX);
+    ent_filename[FILENAME_MAX - 1] = '\0';
+    char *dot = strrchr(ent_filename, '.');
+    if (dot != NULL) {
+        strcpy(dot, ".ent");
+    } else {
+        strcat(ent_filename, ".ent");
+    }
+
+    /* Open the file for writing */
+    ent_fp = fopen(ent_filename, "w");
+    if (!ent_fp) {
+        report_error(0, 0, "io", "could not create %s", ent_filename);
+        return;
+    }
+
+    write_entries(ent_fp);
+    fclose(ent_fp);
+}
+
+/* Writes the .ext file that lists where external labels were used */
+void write_ext_file(const char *filename) {
+    FILE *ext_file;
+    char ext_filename[FILENAME_MAX];
+    char *dot;
+
+    /* Generate the file name with .ext extension */
+    strncpy(ext_filename, filename, FILENAME_MAX);
+    ext_filename[FILENAME_MAX - 1] = '\0';
+    dot = strrchr(ext_filename, '.');
+    if (dot) strcpy(dot, ".ext");
+    else    strcat(ext_filename, ".ext");
+
+    ext_file = fopen(ext_filename, "w");
+    if (!ext_file) {
+        report_error(0, 0, "io", "could not create %s", ext_filename);
+        return;
+    }
+
+    write_externals(ext_file);
+    fclose(ext_file);
+}
+
+/* Convert a word into WORD_DIGITS “base-4” chars: a=00, b=01, c=10, d=11 */
+void word_to_base4(int word, char out[WORD_DIGITS + 1]) {
+    int i;
+    /* We split the word into groups of 2 bits each, the most significant group first */
+    for (i = 0; i < WORD_DIGITS; i++) {
+        int shift = (WORD_DIGITS - 1 - i) * 2;
+        int two_bits = (word >> shift) & 0x3; /* extract 2 bits */
+        /* map 0→'a', 1→'b', 2→'c', 3→'d' */
+        out[i] = (char)('a' + two_bits);
+    }
+    out[WORD_DIGITS] = '\0';
+}
+
+
+/* Relocation records, after the words, for the words that hold label expressions. The linker
+   finds the plain label operands by decoding the instructions, these it cannot tell from
+   numbers. "reloc ADDRESS CODE DATA BSS": moving the code, data and zero-fill segments by
+   c, d and z words changes the word at ADDRESS by CODE*c + DATA*d + BSS*z.
+   "reloc ADDRESS ?": the word cannot follow the segments, so the object cannot be linked. */
+void write_relocations(FILE *out) {
+    static const Fixup *at[MAX_MEMORY];
+    const Fixup *fixup;
+    int i;
+
+    memset((void *)at, 0, sizeof(at));
+    for (fixup = fixup_head; fixup; fixup = fixup->next) {
+        if (fixup->expr && fixup->address >= 100 && fixup->address < MAX_MEMORY) at[fixup->address] = fixup;
+    }
+    for (i = 100; i < MAX_MEMORY; i++) {
+        if (!at[i]) continue;
+        if (at[i]->linear) {
+            fprintf(out, "reloc %d %d %d %d\n", i, at[i]->moves[SEGMENT_CODE],
+                    at[i]->moves[SEGMENT_DATA], at[i]->moves[SEGMENT_BSS]);
+        } else {
+            fprintf(out, "reloc %d ?\n", i);
+        }
+    }
+}
+
+/* Writes the memory image (code + data) in .ob format */
+void write_object(FILE *out) {
+    static char text[MAX_MEMORY * (WORD_DIGITS + 6)];  /* "AAAA ccccc\n" per word at most */
+    char *p = text;
+    int i, shift;
+    int end = memory_counter < MAX_MEMORY ? memory_counter : MAX_MEMORY;   /* past an overflow */
+
+    /* Header: code words count and data words count, then the zero-fill words if any; those
+       have no lines, the loader clears them */
+    if (bss_size > 0) {
+        fprintf(out, "%d %d %d\n", data_start - 100, memory_counter - data_start, bss_size);
+    } else {
+        fprintf(out, "%d %d\n", data_start - 100, memory_counter - data_start);
+    }
+
+    /* Each word as "%03d " and WORD_DIGITS base-4 digits (see word_to_base4), formatted by hand
+       into one buffer and written at once */
+    for (i = 100; i < end; i++) {
+        if (i >= 1000) *p++ = (char)('0' + i / 1000);
+        *p++ = (char)('0' + i / 100 % 10);
+        *p++ = (char)('0' + i / 10 % 10);
+        *p++ = (char)('0' + i % 10);
+        *p++ = ' ';
+        for (shift = (WORD_DIGITS - 1) * 2; shift >= 0; shift -= 2) {
+            *p++ = (char)('a' + ((memory[i] >> shift) & 0x3));
+        }
+        *p++ = '\n';
+    }
+    fwrite(text, 1, (size_t)(p - text), out);
+    write_relocations(out);
+}
+
+/* Creates the .ob file containing the memory image (code + data) */
+void create_ob_file(const char *original_filename) {
+    FILE *ob_fp;
+    char ob_filename[FILENAME_MAX];
+
+    /* Construct .ob filename */
+    strncpy(ob_filename, original_filename, FILENAME_MAX);
+    ob_filename[FILENAME_MAX - 1] = '\0';
+    {
+        char *dot = strrchr(ob_filename, '.');
+        if (dot) strcpy(dot, ".ob");
+        else    strcat(ob_filename, ".ob");
+    }
+
+    ob_fp = fopen(ob_filename, "w");
+    if (!ob_fp) {
+        report_error(0, 0, "io", "could not create %s", ob_filename);
+        return;
+    }
+
+    write_object(ob_fp);
+    fclose(ob_fp);
+}
+
+
+/* Perform the second pass: mark .entry labels, and write .ent, .ext and .ob files */
+void second_pass(FILE *fp, const char *orig_filename) {
+    rewind(fp);
+    mark_entries(fp);
+    generate_extra_operand_words();
+    create_entry_file(orig_filename);
+    write_ext_file(orig_filename);
+    create_ob_file(orig_filename);
+}
+
+
+/* Frees the tables built for one source file so the next one starts from a clean state */
+void reset_assembler_state(void) {
+    Macro *macro, *next_macro;
+    Symbol *sym, *next_sym;
+    InstructionNode *instr, *next_instr;
+    ExternalUse *use, *next_use;
+    Fixup *fixup, *next_fixup;
+
+    for (macro = macro_table; macro; macro = next_macro) {
+        next_macro = macro->next;
+        free_macro(macro);
+    }
+    for (sym = symbol_table_head; sym; sym = next_sym) {
+        next_sym = sym->next;
+        free(sym);
+    }
+    for (instr = instruction_head; instr; instr = next_instr) {
+        next_instr = instr->next;
+        free(instr);
+    }
+    for (use = external_use_head; use; use = next_use) {
+        next_use = use->next;
+        free(use);
+    }
+    for (fixup = fixup_head; fixup; fixup = next_fixup) {
+        next_fixup = fixup->next;
+        free(fixup);
+    }
+    clear_interned_names();
+    include_serial++;
+    macro_table       = NULL;
+    fixup_head        = NULL;
+    symbol_table_head = NULL;
+    instruction_head  = instruction_tail  = NULL;
+    external_use_head = external_use_tail = NULL;
+    memset(memory, 0, sizeof(memory));
+    memory_counter = 100;
+    data_start     = 100;
+    bss_size       = 0;
+}
+
+/* Builds a file name from name with its extension (if any) replaced by ext */
+void make_filename(char *dest, const char *name, const char *ext) {
+    char *dot;
+    strncpy(dest, name, FILENAME_MAX - 16);
+    dest[FILENAME_MAX - 16] = '\0';
+    dot = strrchr(dest, '.');
+    if (dot) strcpy(dot, ext);
+    else    strcat(dest, ext);
+}
+
+
+/* ---- Disassembler: .ob (+ .ent/.ext) back to assembly source ---- */
+
+/* One decoded instruction; a single operand is kept in slot 0 */
+typedef struct {
+    const OpcodeInfo *info;
+    int length;             /* words, including the first one */
+    int modes[2];           /* addressing mode of each operand, -1 if absent */
+    int values[2];          /* immediate value or label address */
+    int regs[2];            /* register of register/index operands */
+    int value_addr[2];      /* address of the word holding values[], -1 if none */
+} DecodedInstruction;
+
+/* Names read from the .ent file (by label address) and .ext file (by operand word address) */
+char disasm_labels[MAX_MEMORY][MAX_LINE_LENGTH];
+char disasm_externs[MAX_MEMORY][MAX_LINE_LENGTH];
+bool disasm_entries[MAX_MEMORY];    /* label came from the .ent file */
+
+/* Converts WORD_DIGITS base-4 chars (a-d) back into a word, the inverse of word_to_base4 */
+int base4_to_word(const char *digits) {
+    int i, word = 0;
+    for (i = 0; i < WORD_DIGITS && digits[i] >= 'a' && digits[i] <= 'd'; i++) {
+        word = (word << 2) | (digits[i] - 'a');
+    }
+    return word;
+}
+
+/* Sign-extends a WORD_BITS-bit word */
+int word_to_int(int word) {
+    word &= WORD_MASK;
+    return (word & WORD_SIGN) ? word - (WORD_MASK + 1) : word;
+}
+
+/* A relocation record of an object, see write_relocations */
+typedef struct Relocation {
+    int address;
+    int moves[SEGMENT_COUNT];
+    bool linear;
+    struct Relocation *next;
+} Relocation;
+
+void free_relocations(Relocation *list) {
+    Relocation *next;
+    for (; list; list = next) {
+        next = list->next;
+        free(list);
+    }
+}
+
+/* Reads an .ob file into mem[] (indexed by address), and its relocation records into
+   *relocations unless that is NULL. Safe to call from several threads at once: on failure it
+   returns false and leaves the message in error[] instead of printing it */
+bool read_object_file(const char *ob_filename, Word mem[], int *code_count, int *data_count,
+                      int *bss_count, Relocation **relocations, char error[]) {
+    FILE *fp = fopen(ob_filename, "r");
+    char digits[MAX_LINE_LENGTH];
+    int address, n = 0, moves[SEGMENT_COUNT];
+    Relocation *record;
+    bool linear;
+    char mark;
+
+    if (!fp) {
+        sprintf(error, "Error: cannot open %.200s", ob_filename);
+        return false;
+    }
+    *bss_count = 0;     /* the header has a third count only with a zero-fill segment */
+    if (!fgets(digits, sizeof(digits), fp) ||
+        sscanf(digits, "%d %d %d", code_count, data_count, bss_count) < 2 ||
+        *code_count < 0 || *data_count < 0 || *bss_count < 0 ||
+        100 + *code_count + *data_count + *bss_count > MAX_MEMORY) {
+        sprintf(error, "%.200s: error: bad object header", ob_filename);
+        fclose(fp);
+        return false;
+    }
+    while (n < *code_count + *data_count && fscanf(fp, "%d %80s", &address, digits) == 2) {
+        if (address != 100 + n) {
+            sprintf(error, "%.200s: error: expected address %d, got %d", ob_filename, 100 + n, address);
+            fclose(fp);
+            return false;
+        }
+        mem[address] = (Word)base4_to_word(digits);
+        n++;
+    }
+    if (n != *code_count + *data_count) {
+        sprintf(error, "%.200s: error: object file ends after %d words", ob_filename, n);
+        fclose(fp);
+        return false;
+    }
+
+    /* the relocation records after the words, for a caller that asks for them */
+    while (relocations && fgets(digits, sizeof(digits), fp)) {
+        digits[strcspn(digits, "\r\n")] = '\0';
+        if (digits[strspn(digits, " \t")] == '\0') continue;
+        memset(moves, 0, sizeof(moves));
+        linear = sscanf(digits, "reloc %d %d %d %d", &address, &moves[SEGMENT_CODE],
+                        &moves[SEGMENT_DATA], &moves[SEGMENT_BSS]) == 4;
+        if (!linear && (sscanf(digits, "reloc %d %c", &address, &mark) != 2 || mark != '?')) {
+            address = 0;
+        }
+        if (address < 100 || address >= 100 + *code_count + *data_count ||
+            !(record = malloc(sizeof(Relocation)))) {
+            sprintf(error, "%.200s: error: bad relocation record '%.40s'", ob_filename, digits);
+            fclose(fp);
+            return false;
+        }
+        record->address = address;
+        record->linear  = linear;
+        memcpy(record->moves, moves, sizeof(moves));
+        record->next    = *relocations;
+        *relocations    = record;
+    }
+    fclose(fp);
+    return true;
+}
+
+/* Loads an .ob file into memory[], returns false if it cannot be read */
+bool load_object_file(const char *ob_filename, int *code_count, int *data_count) {
+    char error[ERROR_LENGTH];
+    if (!read_object_file(ob_filename, memory, code_count, data_count, &bss_size, NULL, error)) {
+        fprintf(stderr, "%s\n", error);
+        return false;
+    }
+    data_start     = 100 + *code_count;
+    memory_counter = data_start + *data_count;
+    return true;
+}
+
+/* Reads "NAME address" lines into names[address]; a missing file just means no names */
+void load_name_file(const char *filename, char names[][MAX_LINE_LENGTH]) {
+    FILE *fp = fopen(filename, "r");
+    char name[MAX_LINE_LENGTH];
+    int address;
+
+    if (!fp) return;
+    while (fscanf(fp, "%80s %d", name, &address) == 2) {
+        if (address >= 0 && address < MAX_MEMORY) {
+            strcpy(names[address], name);
+        }
+    }
+    fclose(fp);
+}
+
+/* Decodes the instruction at address, mirroring encode_instruction and the operand word
+   layout of generate_extra_operand_words. Returns its length in words. */
+int decode_instruction(const Word mem[], int address, int end, DecodedInstruction *d) {
+    int word = mem[address];
+    int next = address + 1;
+    int num, k, reg_word, code = (word >> OPCODE_SHIFT) & OPCODE_MASK;
+
+    /* table index == opcode; a code the ISA leaves unused decodes as the last opcode */
+    d->info = &opcode_table[code < OPCODE_COUNT ? code : OPCODE_COUNT - 1];
+    num = d->info->num_operands;
+    d->modes[0] = num >= 1 ? (word >> SRC_MODE_SHIFT) & SRC_MODE_MASK : -1;
+    d->modes[1] = num == 2 ? (word >> DST_MODE_SHIFT) & DST_MODE_MASK : -1;
+    for (k = 0; k < 2; k++) {
+        d->values[k] = 0;
+        d->regs[k] = 0;
+        d->value_addr[k] = -1;
+    }
+
+    if (HOLDS_REGISTER(d->modes[0]) && HOLDS_REGISTER(d->modes[1])) {
+        /* index base words, then one shared register word */
+        for (k = 0; k < 2; k++) {
+            if (d->modes[k] == ADDR_INDEX && next < end) {
+                d->value_addr[k] = next;
+                d->values[k] = mem[next++];
+            }
+        }
+        reg_word = next < end ? mem[next++] : 0;
+        d->regs[0] = (reg_word >> REGISTER_BITS) & REGISTER_MASK;
+        d->regs[1] = reg_word & REGISTER_MASK;
+    } else {
+        for (k = 0; k < num && next < end; k++) {
+            if (d->modes[k] == ADDR_IMMEDIATE) {
+                d->value_addr[k] = next;
+                d->values[k] = word_to_int(mem[next++]);
+            } else if (d->modes[k] == ADDR_DIRECT) {
+                d->value_addr[k] = next;
+                d->values[k] = mem[next++];
+            } else if (d->modes[k] == ADDR_INDEX) {
+                d->value_addr[k] = next;
+                d->values[k] = mem[next++];
+                if (next < end) d->regs[k] = mem[next++] & REGISTER_MASK;
+            } else {
+                d->regs[k] = mem[next++] & REGISTER_MASK;
+            }
+        }
+    }
+    d->length = next - address;
+    return d->length;
+}
+
+/* Name of the label an operand refers to: the external name if the word is listed in the
+   .ext file, otherwise the label at its address (a generated Lnnn if it has none yet) */
+const char *operand_label(const DecodedInstruction *d, int k) {
+    static char generated[MAX_LINE_LENGTH];
+    int target = d->values[k];
+
+    if (d->value_addr[k] >= 0 && disasm_externs[d->value_addr[k]][0]) {
+        return disasm_externs[d->value_addr[k]];
+    }
+    if (target >= 0 && target < MAX_MEMORY) {
+        if (!disasm_labels[target][0]) {
+            sprintf(disasm_labels[target], "L%03d", target);
+        }
+        return disasm_labels[target];
+    }
+    sprintf(generated, "L%03d", target);
+    return generated;
+}
+
+/* Writes operand k of a decoded instruction as source text */
+void print_operand(FILE *out, const DecodedInstruction *d, int k) {
+    switch (d->modes[k]) {
+    case ADDR_IMMEDIATE: fprintf(out, "#%d", d->values[k]); break;
+    case ADDR_DIRECT:    fprintf(out, "%s", operand_label(d, k)); break;
+    case ADDR_INDEX:     fprintf(out, "%s[r%d]", operand_label(d, k), d->regs[k]); break;
+    default:             fprintf(out, "r%d", d->regs[k]); break;
+    }
+}
+
+/* Writes the data words in [start, end) as .string/.data lines, the label goes on the first one */
+void disassemble_data(FILE *out, const char *label, int start, int end) {
+    int i = start, j, n;
+
+    while (i < end) {
+        if (i == start && label[0]) fprintf(out, "%s: ", label);
+
+        /* printable chars closed by a 0 inside the block read back as .string */
+        for (j = i; j < end && j - i < 60 && memory[j] >= 32 && memory[j] < 127 &&
+                    memory[j] != '"'; j++)
+            ;
+        if (j > i && j < end && memory[j] == 0) {
+            fprintf(out, ".string \"");
+            for (; i < j; i++) fputc(memory[i], out);
+            fprintf(out, "\"\n");
+            i = j + 1;
+        } else {
+            fprintf(out, ".data ");
+            for (n = 0; i < end && n < 8; n++, i++) {
+                fprintf(out, n ? ",%d" : "%d", word_to_int(memory[i]));
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
+
+/* Disassembles an .ob file into out_filename, using the matching .ent/.ext files for names */
+bool disassemble_file(const char *ob_filename, const char *out_filename) {
+    char name_file[FILENAME_MAX];
+    FILE *out;
+    DecodedInstruction d;
+    int code_count, data_count, code_end, addr, k, start;
+
+    reset_assembler_state();
+    memset(disasm_labels, 0, sizeof(disasm_labels));
+    memset(disasm_externs, 0, sizeof(disasm_externs));
+    memset(disasm_entries, 0, sizeof(disasm_entries));
+    if (!load_object_file(ob_filename, &code_count, &data_count)) {
+        return false;
+    }
+    code_end = 100 + code_count;
+
+    make_filename(name_file, ob_filename, ".ent");
+    load_name_file(name_file, disasm_labels);
+    for (addr = 0; addr < MAX_MEMORY; addr++) {
+        disasm_entries[addr] = disasm_labels[addr][0] != '\0';
+    }
+    make_filename(name_file, ob_filename, ".ext");
+    load_name_file(name_file, disasm_externs);
+
+    out = fopen(out_filename, "w");
+    if (!out) {
+        fprintf(stderr, "Error: could not create %s\n", out_filename);
+        return false;
+    }
+
+    /* 1) generate labels for every address an operand refers to */
+    for (addr = 100; addr < code_end; addr += decode_instruction(memory, addr, code_end, &d)) {
+        for (k = 0; k < 2; k++) {
+            if (d.modes[k] == ADDR_DIRECT || d.modes[k] == ADDR_INDEX) operand_label(&d, k);
+        }
+    }
+
+    /* 2) declarations */
+    for (addr = 0; addr < MAX_MEMORY; addr++) {
+        if (!disasm_externs[addr][0]) continue;
+        for (k = 0; k < addr && strcmp(disasm_externs[k], disasm_externs[addr]) != 0; k++)
+            ;
+        if (k == addr) fprintf(out, ".extern %s\n", disasm_externs[addr]);
+    }
+    for (addr = 0; addr < MAX_MEMORY; addr++) {
+        if (disasm_entries[addr]) fprintf(out, ".entry %s\n", disasm_labels[addr]);
+    }
+
+    /* 3) code */
+    for (addr = 100; addr < code_end; addr += d.length) {
+        decode_instruction(memory, addr, code_end, &d);
+        if (disasm_labels[addr][0]) fprintf(out, "%s: ", disasm_labels[addr]);
+        fprintf(out, "%s", d.info->name);
+        for (k = 0; k < 2 && d.modes[k] >= 0; k++) {
+            fprintf(out, k ? ", " : " ");
+            print_operand(out, &d, k);
+        }
+        fprintf(out, "\n");
+    }
+
+    /* 4) data, one block per label */
+    for (start = code_end; start < memory_counter; start = addr) {
+        for (addr = start + 1; addr < memory_counter && !disasm_labels[addr][0]; addr++)
+            ;
+        disassemble_data(out, disasm_labels[start], start, addr);
+    }
+
+    /* 5) the zero-fill segment, one .space per label */
+    for (start = memory_counter; start < memory_counter + bss_size; start = addr) {
+        for (addr = start + 1; addr < memory_counter + bss_size && !disasm_labels[addr][0]; addr++)
+            ;
+        if (disasm_labels[start][0]) fprintf(out, "%s: ", disasm_labels[start]);
+        fprintf(out, ".space %d\n", addr - start);
+    }
+
+    /* labels past the last word */
+    for (addr = memory_counter + bss_size; addr < MAX_MEMORY; addr++) {
+        if (disasm_labels[addr][0]) fprintf(out, "%s:\n", disasm_labels[addr]);
+    }
+
+    fclose(out);
+    return true;
+}
+
+
+/* ---- Linker: combines several .ob/.ent/.ext outputs into one image ---- */
+
+/* One "NAME address" line of a .ent or .ext file. The linker loads these from several
+   threads, so the names are kept as text rather than interned. */
+typedef struct NameAddress {
+    char name[MAX_LINE_LENGTH];
+    int address;
+    struct NameAddress *next;
+} NameAddress;
+
+/* One object being linked */
+typedef struct LinkObject {
+    char name[FILENAME_MAX];
+    int index;              /* position on the command line, decides which duplicate wins */
+    int code_count;
+    int data_count;
+    int bss_count;          /* words of its zero-fill segment */
+    int code_base;          /* final address of its first code word */
+    int data_base;          /* final address of its first data word */
+    int bss_base;           /* final address of its first zero-fill word */
+    Word *mem;              /* the object's words, indexed by address inside the object */
+    Relocation *relocations;    /* its words that hold label expressions */
+    NameAddress *entries;   /* .ent lines (address inside the object) */
+    NameAddress *externs;   /* .ext lines (operand word inside the object) */
+    int errors;             /* undefined externals found while relocating */
+    char error[ERROR_LENGTH];   /* load error, empty if it loaded */
+} LinkObject;
+
+/* Global index of entry labels over all objects. It is split into shards with their own
+   lock so objects can be indexed from several threads at once. */
+#define LINK_SHARDS 16
+#define LINK_SHARD_BUCKETS 256
+
+typedef struct LinkEntry {
+    char name[MAX_LINE_LENGTH];
+    int address;            /* final address */
+    const LinkObject *object;   /* defining object with the lowest index */
+    struct LinkEntry *next;
+} LinkEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    LinkEntry *buckets[LINK_SHARD_BUCKETS];
+} LinkShard;
+
+LinkShard link_shards[LINK_SHARDS];
+
+/* Looks up an entry; only called once indexing is finished, so no lock is taken */
+LinkEntry *find_link_entry(const char *name) {
+    unsigned long h = hash_name(name);
+    LinkEntry *cur = link_shards[h % LINK_SHARDS].buckets[(h / LINK_SHARDS) % LINK_SHARD_BUCKETS];
+    while (cur && strcmp(cur->name, name) != 0) {
+        cur = cur->next;
+    }
+    return cur;
+}
+
+/* Reads "NAME address" lines into a list, in file order; a missing file gives an empty list */
+NameAddress *read_name_list(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    NameAddress *head = NULL, *tail = NULL, *item;
+    char name[MAX_LINE_LENGTH];
+    int address;
+
+    if (!fp) return NULL;
+    while (fscanf(fp, "%80s %d", name, &address) == 2) {
+        item = malloc(sizeof(NameAddress));
+        if (!item) break;
+        strcpy(item->name, name);
+        item->address = address;
+        item->next = NULL;
+        if (tail) tail->next = item;
+        else head = item;
+        tail = item;
+    }
+    fclose(fp);
+    return head;
+}
+
+void free_name_list(NameAddress *list) {
+    NameAddress *next;
+    for (; list; list = next) {
+        next = list->next;
+        free(list);
+    }
+}
+
+/* Maps an address inside obj to its address in the linked image */
+int relocate_address(const LinkObject *obj, int address) {
+    if (address >= 100 && address < 100 + obj->code_count) {
+        return obj->code_base + (address - 100);
+    }
+    if (obj->bss_count > 0 && address >= 100 + obj->code_count + obj->data_count &&
+        address < 100 + obj->code_count + obj->data_count + obj->bss_count) {
+        return obj->bss_base + (address - 100 - obj->code_count - obj->data_count);
+    }
+    if (address >= 100 + obj->code_count && address <= 100 + obj->code_count + obj->data_count) {
+        return obj->data_base + (address - 100 - obj->code_count);
+    }
+    return address;     /* unresolved (0) or outside the object */
+}
+
+/* Loads the .ob/.ent/.ext files of one object; on failure obj->error is set */
+void load_link_object(LinkObject *obj) {
+    char name_file[FILENAME_MAX];
+
+    obj->mem = malloc(sizeof(Word) * MAX_MEMORY);
+    if (!obj->mem) {
+        sprintf(obj->error, "Error: memory allocation failed for %.200s", obj->name);
+        return;
+    }
+    if (!read_object_file(obj->name, obj->mem, &obj->code_count, &obj->data_count, &obj->bss_count,
+                          &obj->relocations, obj->error)) {
+        return;
+    }
+    make_filename(name_file, obj->name, ".ent");
+    obj->entries = read_name_list(name_file);
+    make_filename(name_file, obj->name, ".ext");
+    obj->externs = read_name_list(name_file);
+}
+
+/* Adds the entries of obj to the sharded index. When two objects define the same name the
+   one with the lower index is kept, whatever order the threads run in. */
+void index_link_entries(const LinkObject *obj) {
+    NameAddress *ent;
+    LinkEntry *entry;
+    LinkShard *shard;
+    unsigned long h;
+    int address;
+
+    for (ent = obj->entries; ent; ent = ent->next) {
+        h = hash_name(ent->name);
+        shard = &link_shards[h % LINK_SHARDS];
+        address = relocate_address(obj, ent->address);
+
+        pthread_mutex_lock(&shard->lock);
+        entry = shard->buckets[(h / LINK_SHARDS) % LINK_SHARD_BUCKETS];
+        while (entry && strcmp(entry->name, ent->name) != 0) {
+            entry = entry->next;
+        }
+        if (!entry) {
+            entry = malloc(sizeof(LinkEntry));
+            if (entry) {
+                strcpy(entry->name, ent->name);
+                entry->address = address;
+                entry->object  = obj;
+                entry->next    = shard->buckets[(h / LINK_SHARDS) % LINK_SHARD_BUCKETS];
+                shard->buckets[(h / LINK_SHARDS) % LINK_SHARD_BUCKETS] = entry;
+            }
+        } else if (obj->index < entry->object->index) {
+            entry->address = address;
+            entry->object  = obj;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Relocates the address words of obj, patches its external references and copies the
+   result into image[]. Counts undefined externals in obj->errors. */
+void relocate_link_object(LinkObject *obj, int image[]) {
+    DecodedInstruction d;
+    NameAddress *ext;
+    LinkEntry *entry;
+    Relocation *record;
+    bool recorded[MAX_MEMORY];
+    int shift[SEGMENT_COUNT];
+    int code_end = 100 + obj->code_count;
+    int i, k, s, addr;
+
+    memset(recorded, 0, sizeof(recorded));
+    for (record = obj->relocations; record; record = record->next) {
+        recorded[record->address] = true;
+    }
+
+    /* which words hold addresses is known from the instructions that use them, the words
+       with a relocation record hold expressions and are moved below instead */
+    for (addr = 100; addr < code_end; addr += d.length) {
+        decode_instruction(obj->mem, addr, code_end, &d);
+        for (k = 0; k < 2; k++) {
+            if (d.value_addr[k] >= 0 && !recorded[d.value_addr[k]] &&
+                (d.modes[k] == ADDR_DIRECT || d.modes[k] == ADDR_INDEX)) {
+                obj->mem[d.value_addr[k]] = (Word)relocate_address(obj, d.values[k]);
+            }
+        }
+    }
+
+    /* an expression moves with the segments of its labels; one that cannot is reported
+       by link_objects */
+    shift[SEGMENT_CODE] = obj->code_base - 100;
+    shift[SEGMENT_DATA] = obj->data_base - code_end;
+    shift[SEGMENT_BSS]  = obj->bss_base - code_end - obj->data_count;
+    for (record = obj->relocations; record; record = record->next) {
+        if (!record->linear) continue;
+        for (s = 0; s < SEGMENT_COUNT; s++) {
+            obj->mem[record->address] = (Word)(obj->mem[record->address] + record->moves[s] * shift[s]);
+        }
+    }
+
+    /* external words hold 0 until the entry they name is known */
+    obj->errors = 0;
+    for (ext = obj->externs; ext; ext = ext->next) {
+        entry = find_link_entry(ext->name);
+        if (!entry) {
+            obj->errors++;
+        } else if (ext->address >= 100 && ext->address < code_end) {
+            obj->mem[ext->address] = (Word)entry->address;
+        }
+    }
+
+    for (i = 0; i < obj->code_count; i++) {
+        image[obj->code_base + i] = obj->mem[100 + i];
+    }
+    for (i = 0; i < obj->data_count; i++) {
+        image[obj->data_base + i] = obj->mem[code_end + i];
+    }
+}
+
+/* Work shared by the link threads: each phase hands out objects through next_object */
+typedef struct {
+    LinkObject *objects;
+    int count;
+    int phase;              /* 0 = load, 1 = index entries, 2 = relocate */
+    int *image;
+    int next_object;
+    pthread_mutex_t lock;
+} LinkWork;
+
+void *link_worker(void *arg) {
+    LinkWork *work = (LinkWork *)arg;
+    LinkObject *obj;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&work->lock);
+        i = work->next_object++;
+        pthread_mutex_unlock(&work->lock);
+        if (i >= work->count) break;
+
+        obj = &work->objects[i];
+        if (work->phase == 0) load_link_object(obj);
+        else if (work->phase == 1) index_link_entries(obj);
+        else relocate_link_object(obj, work->image);
+    }
+    return NULL;
+}
+
+/* Runs one phase over all objects on up to opt_jobs threads */
+void run_link_phase(LinkWork *work, int phase) {
+    pthread_t threads[MAX_LINK_JOBS];
+    int i, started = 0, jobs = opt_jobs;
+
+    if (jobs > work->count) jobs = work->count;
+    if (jobs > MAX_LINK_JOBS) jobs = MAX_LINK_JOBS;
+
+    work->phase = phase;
+    work->next_object = 0;
+    for (i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[started], NULL, link_worker, work) != 0) break;
+        started++;
+    }
+    link_worker(work);     /* the calling thread helps too */
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void clear_link_entries(void) {
+    LinkEntry *cur, *next;
+    int i, j;
+    for (i = 0; i < LINK_SHARDS; i++) {
+        for (j = 0; j < LINK_SHARD_BUCKETS; j++) {
+            for (cur = link_shards[i].buckets[j]; cur; cur = next) {
+                next = cur->next;
+                free(cur);
+            }
+            link_shards[i].buckets[j] = NULL;
+        }
+    }
+}
+
+/* Links the given .ob files into out_filename (.ob/.ent/.ext), returns false on errors.
+   Code segments are placed one after the other, followed by all data segments, then all
+   zero-fill segments. Objects are loaded, indexed and relocated in parallel; errors are
+   reported afterwards in command line order so the output does not depend on thread timing. */
+bool link_objects(char *ob_filenames[], int count, const char *out_filename) {
+    static int image[MAX_MEMORY];
+    LinkObject *objects, *obj;
+    LinkWork work;
+    LinkEntry *entry;
+    NameAddress *ent;
+    Relocation *record;
+    Symbol *sym;
+    int i, code_total = 0, data_total = 0, bss_total = 0, next_code, next_data, next_bss, errors = 0;
+
+    objects = calloc(count > 0 ? count : 1, sizeof(LinkObject));
+    if (!objects) {
+        fprintf(stderr, "Error: memory allocation failed for link objects\n");
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        strncpy(objects[i].name, ob_filenames[i], FILENAME_MAX);
+        objects[i].name[FILENAME_MAX - 1] = '\0';
+        objects[i].index = i;
+    }
+    for (i = 0; i < LINK_SHARDS; i++) {
+        pthread_mutex_init(&link_shards[i].lock, NULL);
+    }
+    work.objects = objects;
+    work.count   = count;
+    work.image   = image;
+    pthread_mutex_init(&work.lock, NULL);
+
+    /* 1) load every object */
+    run_link_phase(&work, 0);
+    for (i = 0; i < count; i++) {
+        if (objects[i].error[0]) {
+            fprintf(stderr, "%s\n", objects[i].error);
+            errors++;
+        }
+        code_total += objects[i].code_count;
+        data_total += objects[i].data_count;
+        bss_total  += objects[i].bss_count;
+    }
+    if (!errors && 100 + code_total + data_total + bss_total > MAX_MEMORY) {
+        fprintf(stderr, "Error: linked image of %d words does not fit in memory\n",
+                code_total + data_total + bss_total);
+        errors++;
+    }
+
+    if (!errors) {
+        /* 2) assign segment bases */
+        next_code = 100;
+        next_data = 100 + code_total;
+        next_bss  = 100 + code_total + data_total;
+        for (i = 0; i < count; i++) {
+            objects[i].code_base = next_code;
+            objects[i].data_base = next_data;
+            objects[i].bss_base  = next_bss;
+            next_code += objects[i].code_count;
+            next_data += objects[i].data_count;
+            next_bss  += objects[i].bss_count;
+        }
+
+        /* 3) global entry index, then duplicates in command line order */
+        run_link_phase(&work, 1);
+        for (i = 0; i < count; i++) {
+            for (ent = objects[i].entries; ent; ent = ent->next) {
+                entry = find_link_entry(ent->name);
+                if (entry && entry->object != &objects[i]) {
+                    fprintf(stderr, "%s: error: entry '%s' already defined in %s\n",
+                            objects[i].name, ent->name, entry->object->name);
+                    errors++;
+                }
+            }
+        }
+
+        /* 4) relocate and patch externals, then report undefined ones */
+        run_link_phase(&work, 2);
+        for (i = 0; i < count; i++) {
+            obj = &objects[i];
+            for (record = obj->relocations; record; record = record->next) {
+                if (record->linear) continue;
+                fprintf(stderr, "%s: error: word %d holds a label expression that cannot be relocated\n",
+                        obj->name, record->address);
+                errors++;
+            }
+            if (!obj->errors) continue;
+            for (ent = obj->externs; ent; ent = ent->next) {
+                if (!find_link_entry(ent->name)) {
+                    fprintf(stderr, "%s: error: undefined external '%s' (used at %d)\n",
+                            obj->name, ent->name, ent->address);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    if (!errors) {
+        /* write the image through the normal output functions */
+        reset_assembler_state();
+        for (i = 100; i < next_data; i++) {
+            memory[i] = (Word)image[i];
+        }
+        data_start     = 100 + code_total;
+        memory_counter = next_data;
+        bss_size       = bss_total;
+        for (i = count - 1; i >= 0; i--) {
+            for (ent = objects[i].entries; ent; ent = ent->next) {
+                entry = find_link_entry(ent->name);
+                if (!entry || entry->object != &objects[i]) continue;
+                sym = malloc(sizeof(Symbol));
+                if (!sym) continue;
+                sym->name        = intern_name(entry->name);
+                sym->address     = entry->address;
+                sym->is_data     = entry->address >= 100 + code_total;
+                sym->is_external = false;
+                sym->is_entry    = true;
+                sym->is_bss      = false;
+                sym->next        = symbol_table_head;
+                symbol_table_head = sym;
+            }
+        }
+        create_entry_file(out_filename);
+        write_ext_file(out_filename);
+        create_ob_file(out_filename);
+    }
 
-        strncpy(buffer, line_ptr, MAX_LINE_LENGTH);
-        buffer[MAX_LINE_LENGTH-1] = '\0';
+    clear_link_entries();
+    for (i = 0; i < count; i++) {
+        free(objects[i].mem);
+        free_name_list(objects[i].entries);
+        free_name_list(objects[i].externs);
+        free_relocations(objects[i].relocations);
+    }
+    free(objects);
+    pthread_mutex_destroy(&work.lock);
+    for (i = 0; i < LINK_SHARDS; i++) {
+        pthread_mutex_destroy(&link_shards[i].lock);
+    }
+    return errors == 0;
+}
 
-        token = strtok(buffer, ", \t\n");
-        while (token) {
-            int value = atoi(token);
-            if (memory_counter >= MAX_MEMORY) {
-                fprintf(stderr, "Error: memory overflow in .data\n");
-                return;
-            }
-            memory[memory_counter].address = memory_counter;
-            memory[memory_counter].value   = value;
-            memory[memory_counter].is_code = 0;
-            memory_counter++;
-            token = strtok(NULL, ", \t\n");
+/* Output buffer for --dump, written to stdout in one go */
+typedef struct DumpBuffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} DumpBuffer;
+
+/* Appends n bytes of text, growing the buffer as needed */
+bool dump_append(DumpBuffer *buf, const char *text, size_t n) {
+    if (buf->length + n + 1 > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        char *data;
+        while (buf->length + n + 1 > capacity) capacity *= 2;
+        data = realloc(buf->data, capacity);
+        if (!data) return false;
+        buf->data     = data;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->length, text, n);
+    buf->length += n;
+    buf->data[buf->length] = '\0';
+    return true;
+}
+
+bool dump_text(DumpBuffer *buf, const char *text) {
+    return dump_append(buf, text, strlen(text));
+}
+
+/* Appends s as a JSON string literal */
+bool dump_json_string(DumpBuffer *buf, const char *s) {
+    char esc[8];
+    bool ok = dump_append(buf, "\"", 1);
+    for (; *s && ok; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = (char)c;
+            ok = dump_append(buf, esc, 2);
+        } else if (c < 0x20) {
+            sprintf(esc, "\\u%04x", c);
+            ok = dump_append(buf, esc, 6);
+        } else {
+            ok = dump_append(buf, s, 1);
         }
-        return;
     }
+    return ok && dump_append(buf, "\"", 1);
+}
 
-    /* .string directive */
-    if (strncmp(line_ptr, ".string", 7) == 0) {
-        line_ptr += 7;
-        while (isspace((unsigned char)*line_ptr)) line_ptr++;
+/* "code", "data" or "external", as used by the csv and json dumps */
+const char *symbol_kind(const Symbol *sym) {
+    return sym->is_external ? "external" : (sym->is_data ? "data" : "code");
+}
 
-        if (*line_ptr != '"') {
-            fprintf(stderr, "Error: invalid .string format\n");
-            return;
+/* Appends the memory image and symbol table of src in the --dump format */
+bool dump_tables(DumpBuffer *buf, const char *src) {
+    static bool csv_header_written = false;     /* once per run, all files share the table */
+    char row[MAX_LINE_LENGTH * 2 + 64];
+    Symbol *sym;
+    bool ok = true;
+    int i;
+    int end = memory_counter < MAX_MEMORY ? memory_counter : MAX_MEMORY;   /* past an overflow */
+
+    switch (opt_dump) {
+    case DUMP_TEXT:
+        ok = dump_text(buf, "\n--- Memory Content ---\n");
+        for (i = 100; i < end && ok; i++) {
+            sprintf(row, "Address: %03d | Value: %d | Type: %s\n",
+                    i, memory[i], i < data_start ? "Code" : "Data");
+            ok = dump_text(buf, row);
         }
-        line_ptr++;  /* skip opening quote */
+        ok = ok && dump_text(buf, "\n--- Symbol Table ---\n");
+        for (sym = symbol_table_head; sym && ok; sym = sym->next) {
+            sprintf(row, "Label: %s | Address: %03d | Type: %s%s\n",
+                    name_text(sym->name), sym->address,
+                    sym->is_external ? "External" : (sym->is_data ? "Data" : "Code"),
+                    sym->is_entry ? " | Entry" : "");
+            ok = dump_text(buf, row);
+        }
+        break;
 
-        while (*line_ptr && *line_ptr != '"') {
-            if (memory_counter >= MAX_MEMORY) {
-                fprintf(stderr, "Error: memory overflow in .string\n");
-                return;
-            }
-            memory[memory_counter].address = memory_counter;
-            memory[memory_counter].value   = (int)*line_ptr;
-            memory[memory_counter].is_code = 0;
-            memory_counter++;
-            line_ptr++;
+    case DUMP_CSV:
+        /* one table for both: memory rows leave name empty, symbol rows leave value empty */
+        if (!csv_header_written) {
+            ok = dump_text(buf, "file,section,name,address,value,type,entry\n");
+            csv_header_written = true;
         }
-        if (*line_ptr != '"') {
-            fprintf(stderr, "Error: missing closing quote in .string\n");
-            return;
+        for (i = 100; i < end && ok; i++) {
+            sprintf(row, ",memory,,%d,%d,%s,\n", i, memory[i], i < data_start ? "code" : "data");
+            ok = dump_text(buf, src) && dump_text(buf, row);
         }
-        /* add null terminator */
-        if (memory_counter >= MAX_MEMORY) {
-            fprintf(stderr, "Error: memory overflow in .string\n");
-            return;
+        for (sym = symbol_table_head; sym && ok; sym = sym->next) {
+            sprintf(row, ",symbol,%s,%d,,%s,%d\n",
+                    name_text(sym->name), sym->address, symbol_kind(sym), sym->is_entry ? 1 : 0);
+            ok = dump_text(buf, src) && dump_text(buf, row);
         }
-        memory[memory_counter].address = memory_counter;
-        memory[memory_counter].value   = 0;
-        memory[memory_counter].is_code = 0;
-        memory_counter++;
-        return;
-    }
-
-    /* .mat directive */
-    if (strncmp(line_ptr, ".mat", 4) == 0) {
-        int rows, cols;
-        /* parse dimensions */
-        if (sscanf(line_ptr + 4, " [%d][%d]", &rows, &cols) != 2 || rows <= 0 || cols <= 0) {
-            fprintf(stderr, "Error: invalid .mat dimensions\n");
-            return;
+        break;
+
+    case DUMP_JSON:
+        /* one line per source file */
+        ok = dump_text(buf, "{\"file\":") && dump_json_string(buf, src) &&
+             dump_text(buf, ",\"memory\":[");
+        for (i = 100; i < end && ok; i++) {
+            sprintf(row, "%s{\"address\":%d,\"value\":%d,\"type\":\"%s\"}", i == 100 ? "" : ",",
+                    i, memory[i], i < data_start ? "code" : "data");
+            ok = dump_text(buf, row);
         }
-        /* move past the closing ']' */
-        char *p = strchr(line_ptr, ']');
-        if (!p || !(p = strchr(p + 1, ']'))) {
-            fprintf(stderr, "Error: malformed .mat directive\n");
-            return;
+        ok = ok && dump_text(buf, "],\"symbols\":[");
+        for (sym = symbol_table_head; sym && ok; sym = sym->next) {
+            ok = dump_text(buf, sym == symbol_table_head ? "{\"name\":" : ",{\"name\":") &&
+                 dump_json_string(buf, name_text(sym->name));
+            sprintf(row, ",\"address\":%d,\"type\":\"%s\",\"entry\":%s}",
+                    sym->address, symbol_kind(sym), sym->is_entry ? "true" : "false");
+            ok = ok && dump_text(buf, row);
         }
-        p++;  /* now at initializer list or end */
+        ok = ok && dump_text(buf, "]}\n");
+        break;
 
-        while (isspace((unsigned char)*p)) p++;
+    default:
+        break;
+    }
+    return ok;
+}
 
-        int total = rows * cols;
-        int init_count = 0;
+/* Writes the --dump output of the file just assembled to stdout with a single write */
+void write_dump(const char *src) {
+    DumpBuffer buf = { NULL, 0, 0 };
 
-        if (*p && *p != '\n') {
-            strncpy(buffer, p, MAX_LINE_LENGTH);
-            buffer[MAX_LINE_LENGTH-1] = '\0';
-            token = strtok(buffer, ", \t\n");
-            while (token && init_count < total) {
-                int value = atoi(token);
-                if (memory_counter >= MAX_MEMORY) {
-                    fprintf(stderr, "Error: memory overflow in .mat\n");
-                    return;
-                }
-                memory[memory_counter].address = memory_counter;
-                memory[memory_counter].value   = value;
-                memory[memory_counter].is_code = 0;
-                memory_counter++;
-                init_count++;
-                token = strtok(NULL, ", \t\n");
-            }
-            if (token) {
-                fprintf(stderr, "Error: too many initializers for .mat\n");
-                return;
+    if (!dump_tables(&buf, src)) {
+        report_error(0, 0, "alloc", "memory allocation failed for the dump");
+    } else if (buf.length > 0) {
+        fflush(stdout);
+        fwrite(buf.data, 1, buf.length, stdout);
+        fflush(stdout);
+    }
+    free(buf.data);
+}
+
+
+
+/* Collapses the spaces and tabs of one line to single spaces, trimming both ends */
+void collapse_spaces(const char *line, char *buf) {
+    int r = 0, w = 0;
+    bool in_space = false;
+    /* Trim leading spaces/tabs */
+    while (line[r] && isspace((unsigned char)line[r])) r++;
+    /* Process rest */
+    for (; line[r] && line[r] != '\n'; r++) {
+        if (isspace((unsigned char)line[r])) {
+            if (!in_space) {
+                buf[w++] = ' ';
+                in_space = true;
             }
+        } else {
+            buf[w++] = line[r];
+            in_space = false;
         }
-        /* zero-fill remaining */
-        while (init_count < total) {
-            if (memory_counter >= MAX_MEMORY) {
-                fprintf(stderr, "Error: memory overflow in .mat\n");
-                return;
-            }
-            memory[memory_counter].address = memory_counter;
-            memory[memory_counter].value   = 0;
-            memory[memory_counter].is_code = 0;
-            memory_counter++;
-            init_count++;
+        if (w >= MAX_LINE_LENGTH - 1) break;
+    }
+    /* Trim trailing space */
+    if (w > 0 && buf[w - 1] == ' ') w--;
+    buf[w] = '\0';
+}
+
+/* Removes the spaces right before or after commas in one line */
+void strip_comma_spaces(const char *line, char *buf) {
+    int r = 0, w = 0;
+    char c;
+    while ((c = line[r++]) && c != '\n') {
+        if (c == ' ' && line[r] == ',') continue;
+        if (c == ',' && line[r] == ' ') {
+            buf[w++] = ',';
+            r++;
+            continue;
         }
+        buf[w++] = c;
+    }
+    buf[w] = '\0';
+}
+
+/* Step 1: Remove extra spaces and tabs, collapse to single spaces */
+void remove_extra_spaces_file(const char *in_filename, const char *out_filename) {
+    FILE *fin = fopen(in_filename, "r");
+    FILE *fout = fopen(out_filename, "w");
+    char line[MAX_LINE_LENGTH];
+    if (!fin || !fout) {
+        report_error(0, 0, "io", "could not open %s or %s for cleaning spaces", in_filename, out_filename);
         return;
     }
+    while (fgets(line, MAX_LINE_LENGTH, fin)) {
+        char buf[MAX_LINE_LENGTH];
+        collapse_spaces(line, buf);
+        fprintf(fout, "%s\n", buf);
+    }
+    fclose(fin);
+    fclose(fout);
+}
 
-    /* unknown directive */
-    fprintf(stderr, "Error: unrecognized directive in parse_data_directive\n");
+/* Remove spaces immediately before or after commas -> .t01a */
+void remove_spaces_next_to_comma_file(const char *in_filename, const char *out_filename) {
+    FILE *fin = fopen(in_filename, "r");
+    FILE *fout = fopen(out_filename, "w");
+    char line[MAX_LINE_LENGTH];
+    if (!fin || !fout) {
+        report_error(0, 0, "io", "cannot open %s or %s for comma-spacing", in_filename, out_filename);
+        return;
+    }
+    while (fgets(line, MAX_LINE_LENGTH, fin)) {
+        char buf[MAX_LINE_LENGTH];
+        strip_comma_spaces(line, buf);
+        fprintf(fout, "%s\n", buf);
+    }
+    fclose(fin);
+    fclose(fout);
 }
 
 
-void first_pass(FILE *fp, const char *filename) {
-    char line[MAX_LINE_LENGTH];
-    char *line_ptr;
-    int line_number = 0;
+/* Reads the options given before/between the source files, returns false on an unknown option */
+bool parse_options(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    opt_jobs = cpus > 0 ? (int)cpus : 1;
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || arg[1] == '\0') continue;   /* source file, "-" is stdin */
+
+        if (strcmp(arg, "-O") == 0 || strcmp(arg, "--optimize") == 0) {
+            opt_optimize = true;
+        } else if (strcmp(arg, "--pool-data") == 0) {
+            opt_pool_data = true;
+        } else if (strcmp(arg, "--report-packing") == 0) {
+            opt_report_packing = true;
+        } else if (strcmp(arg, "--disasm") == 0) {
+            opt_disasm = true;
+        } else if (strcmp(arg, "--roundtrip") == 0) {
+            opt_roundtrip = true;
+        } else if (strncmp(arg, "--link=", 7) == 0 && arg[7]) {
+            opt_link_output = arg + 7;
+        } else if (strncmp(arg, "--build-macro-lib=", 18) == 0 && arg[18]) {
+            opt_build_macro_lib = arg + 18;
+        } else if (strncmp(arg, "--macro-lib=", 12) == 0 && arg[12]) {
+            opt_macro_lib = arg + 12;
+        } else if (strncmp(arg, "--output=", 9) == 0 && arg[9]) {
+            opt_output = strcmp(arg + 9, "-") == 0 ? NULL : arg + 9;
+        } else if (strcmp(arg, "--watch") == 0) {
+            opt_watch = true;
+        } else if (strcmp(arg, "--server") == 0) {
+            opt_server = true;
+        } else if (strncmp(arg, "--server=", 9) == 0 && arg[9]) {
+            opt_server = true;
+            opt_socket = arg + 9;
+        } else if (strncmp(arg, "--jobs=", 7) == 0 && atoi(arg + 7) > 0) {
+            opt_jobs = atoi(arg + 7);
+            opt_parallel_pass = true;
+        } else if (strncmp(arg, "--max-errors=", 13) == 0 && isdigit((unsigned char)arg[13])) {
+            opt_max_errors = atoi(arg + 13);
+        } else if (strcmp(arg, "--dump") == 0 || strcmp(arg, "--dump=text") == 0) {
+            opt_dump = DUMP_TEXT;
+        } else if (strcmp(arg, "--dump=csv") == 0) {
+            opt_dump = DUMP_CSV;
+        } else if (strcmp(arg, "--dump=json") == 0) {
+            opt_dump = DUMP_JSON;
+        } else if (strcmp(arg, "--fail-fast") == 0) {
+            opt_fail_fast = true;
+        } else if (strcmp(arg, "--diagnostics=json") == 0) {
+            opt_diag_json = true;
+        } else if (strcmp(arg, "--diagnostics=text") == 0) {
+            opt_diag_json = false;
+        } else if (strcmp(arg, "--batch-io") == 0) {
+            opt_batch_io = BATCH_RING;
+        } else if (strcmp(arg, "--batch-io=sync") == 0) {
+            opt_batch_io = BATCH_SYNC;
+        } else if (strncmp(arg, "--archive=", 10) == 0 && arg[10]) {
+            opt_archive = arg + 10;
+        } else {
+            fprintf(stderr, "Error: unknown option '%s'\n", arg);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Removes the .ob, .ent and .ext files of src */
+void remove_outputs(const char *src) {
+    char filename[FILENAME_MAX];
+    make_filename(filename, src, ".ob");
+    remove(filename);
+    make_filename(filename, src, ".ent");
+    remove(filename);
+    make_filename(filename, src, ".ext");
+    remove(filename);
+}
+
+/* Runs the optional optimizations and lays out the final image of the first pass, the
+   savings the options asked for are reported to report */
+void build_image(const char *src, FILE *report) {
+    int saved;
+
+    if (opt_optimize) {
+        saved = peephole_optimize();
+        fprintf(report, "%s: peephole pass saved %d code word(s)\n", src, saved);
+    }
+    if (opt_pool_data) {
+        fprintf(report, "%s: data pooling saved %d data word(s)\n", src, pooled_words);
+    }
+    generate_extra_operand_words();
+    if (opt_report_packing) {
+        fprintf(report, "%s: register packing saved %d operand word(s)\n", src, packed_words);
+    }
+}
+
+/* Runs the whole pipeline for one source file and writes its .ob, .ent and .ext files.
+   Returns false when the file had errors. */
+bool assemble_file(const char *src) {
+    FILE *fp;
+    char t01[FILENAME_MAX], t01a[FILENAME_MAX];
+    char pre[FILENAME_MAX], am[FILENAME_MAX];
+    char *dot;
+
+    reset_assembler_state();
+    begin_diagnostics(src);
+
+    /* build intermediate filenames based on src */
+    strncpy(t01, src, FILENAME_MAX);
+    t01[FILENAME_MAX-1] = '\0';
+    dot = strrchr(t01, '.');
+    if (dot) strcpy(dot, ".t01"); else strcat(t01, ".t01");
+
+    strncpy(t01a, t01, FILENAME_MAX);
+    t01a[FILENAME_MAX-1] = '\0';
+    dot = strrchr(t01a, '.');
+    if (dot) strcpy(dot, ".t01a"); else strcat(t01a, ".t01a");
+
+    strncpy(pre, src, FILENAME_MAX);
+    pre[FILENAME_MAX-1] = '\0';
+    dot = strrchr(pre, '.');
+    if (dot) strcpy(dot, ".pre"); else strcat(pre, ".pre");
+
+    strncpy(am, src, FILENAME_MAX);
+    am[FILENAME_MAX-1] = '\0';
+    dot = strrchr(am, '.');
+    if (dot) strcpy(dot, ".am"); else strcat(am, ".am");
+
+    /* 1. clean spaces -> .t01 */
+    remove_extra_spaces_file(src, t01);
+    /* 2. remove comma spaces -> .t01a */
+    remove_spaces_next_to_comma_file(t01, t01a);
+    /* 3. collect macro defs -> .pre */
+    preprocess_file(t01a, pre, &pre_source_lines);
+    /* 4. expand macros -> .am */
+    expand_macros(pre, am, &pre_source_lines, &am_source_lines);
+    diagnostic_lines = &am_source_lines;    /* from here on errors come with .am lines */
+
+    /* 5. open .am and first pass */
+    fp = fopen(am, "r");
+    if (!fp) {
+        report_error(0, 0, "io", "cannot open %s", am);
+        return finish_diagnostics();
+    }
+    first_pass(fp);
 
+    /* 7. second pass + outputs */
     rewind(fp);
+    if (!error_limit_reached()) {
+        mark_entries(fp);
+    }
 
-    while (fgets(line, MAX_LINE_LENGTH, fp)) {
-        Symbol *new_sym;
-        InstructionNode *new_instr;
-        char label_name[MAX_LINE_LENGTH];
-        int is_label_line, is_dir, is_instr;
+    /* a broken source leaves no outputs behind, not even those of an earlier build */
+    if (error_limit_reached() || (opt_fail_fast && error_count > 0)) {
+        fclose(fp);
+        remove_outputs(src);
+        return finish_diagnostics();
+    }
+    build_image(src, stdout);
+    create_entry_file(src);
+    write_ext_file(src);
+    create_ob_file(src);
 
-        line_number++;
+    if (opt_dump != DUMP_NONE) {
+        write_dump(src);
+    }
 
-        /* Skip empty or comment lines */
-        if (line[0] == '\n' || line[0] == ';') {
-            continue;
-        }
+    fclose(fp);
+    return finish_diagnostics();
+}
 
-        /* Trim leading whitespace */
-        line_ptr = line;
-        while (isspace((unsigned char)*line_ptr)) {
-            line_ptr++;
-        }
+/* Assembles src, disassembles the .ob it produced, assembles that again and compares both
+   images. The disassembly and everything assembling it wrote are removed afterwards. */
+bool roundtrip_check(const char *src) {
+    static const char *const scratch[] = {".t01", ".t01a", ".pre", ".am", ".ob", ".ent", ".ext"};
+    static int first[MAX_MEMORY];
+    char ob[FILENAME_MAX], dis[FILENAME_MAX], filename[FILENAME_MAX];
+    int first_count, first_bss;
+    bool same = true;
+    int i;
 
-        is_label_line = is_label(line_ptr);
-        is_dir        = is_directive(line_ptr);
-        is_instr      = is_instruction(line_ptr);
+    make_filename(ob, src, ".ob");
+    make_filename(dis, src, ".dis.as");
 
-        /* Handle label definition */
-        if (is_label_line) {
-            /* extract label name */
-            sscanf(line_ptr, "%[^:]:", label_name);
+    first_count = memory_counter;
+    first_bss = bss_size;
+    for (i = 100; i < first_count; i++) {
+        first[i] = memory[i];
+    }
+    if (!disassemble_file(ob, dis)) {
+        return false;
+    }
+    assemble_file(dis);
 
-            new_sym = malloc(sizeof(Symbol));
-            if (!new_sym) {
-                fprintf(stderr, "%s:%d: error: memory allocation failed for symbol\n", filename, line_number);
-                continue;
-            }
-            strcpy(new_sym->name, label_name);
-            new_sym->address      = memory_counter;
-            new_sym->is_entry     = false;
-            new_sym->is_external  = false;
-            new_sym->is_data      = is_dir;
-            new_sym->next         = symbol_table_head;
-            symbol_table_head     = new_sym;
-
-            /* advance pointer past label */
-            line_ptr = strchr(line_ptr, ':');
-            if (line_ptr) {
-                line_ptr++;
-                while (isspace((unsigned char)*line_ptr)) {
-                    line_ptr++;
-                }
-            }
+    if (memory_counter != first_count || bss_size != first_bss) {
+        fprintf(stderr, "%s: round trip: %d words (%d zero-filled), reassembled %s has %d (%d)\n",
+                src, first_count - 100, first_bss, dis, memory_counter - 100, bss_size);
+        same = false;
+    }
+    for (i = 100; same && i < first_count; i++) {
+        if ((first[i] & WORD_MASK) != (memory[i] & WORD_MASK)) {
+            fprintf(stderr, "%s: round trip: word %03d is %d, reassembled %s has %d\n",
+                    src, i, first[i], dis, memory[i]);
+            same = false;
         }
+    }
+    if (same) printf("%s: round trip OK (%d words)\n", src, first_count - 100);
 
-        /* Handle directive (.data/.string/.extern/.entry/.mat) */
-        if (is_dir) {
-            parse_data_directive(line_ptr);
-        }
-        /* Handle instruction */
-        else if (is_instr) {
-            /* validate operand count and addressing modes */
-            if (!validate_instruction(line_ptr, line_number, filename)) {
-                continue;
-            }
+    for (i = 0; i < (int)(sizeof(scratch) / sizeof(scratch[0])); i++) {
+        make_filename(filename, dis, scratch[i]);
+        remove(filename);
+    }
+    remove(dis);
+    return same;
+}
 
-            /* create new instruction node */
-            new_instr = malloc(sizeof(InstructionNode));
-            if (!new_instr) {
-                fprintf(stderr, "%s:%d: error: memory allocation failed for instruction node\n", filename, line_number);
-                continue;
-            }
-            new_instr->address = memory_counter;
-            strncpy(new_instr->line, line_ptr, MAX_LINE_LENGTH);
-            new_instr->line[MAX_LINE_LENGTH - 1] = '\0';
-            new_instr->next = NULL;
-
-            /* append to instruction list */
-            if (instruction_head == NULL) {
-                instruction_head = new_instr;
-                instruction_tail = new_instr;
-            } else {
-                instruction_tail->next = new_instr;
-                instruction_tail = new_instr;
-            }
 
-            /* encode primary instruction word */
-            if (memory_counter < MAX_MEMORY) {
-                memory[memory_counter].address = memory_counter;
-                memory[memory_counter].value   = encode_instruction(line_ptr);
-                memory[memory_counter].is_code = 1;
-            } else {
-                fprintf(stderr, "%s:%d: error: memory overflow when adding instruction\n", filename, line_number);
-            }
-            memory_counter++;
-        }
-        /* Unknown or invalid line */
-        else {
-            fprintf(stderr, "%s:%d: error: unrecognized statement\n", filename, line_number);
-        }
+/* ---- Server mode: stays loaded and assembles sources sent over a stream ----
+   Request:  ASSEMBLE <name> <length>\n<length bytes of source>   or   QUIT\n
+   Response: OK <name>\n then "<tag> <length>\n<bytes>" for LOG, OB, ENT and EXT, then END\n
+   (ERR <message>\n for a malformed request). LOG holds what the assembler printed. */
+
+char *server_buffer = NULL;         /* reused for every request and artifact */
+size_t server_buffer_size = 0;
+
+/* Grows the shared buffer to at least size bytes */
+bool server_reserve(size_t size) {
+    char *bigger;
+    if (size <= server_buffer_size) return true;
+    bigger = realloc(server_buffer, size);
+    if (!bigger) return false;
+    server_buffer = bigger;
+    server_buffer_size = size;
+    return true;
+}
+
+/* Sends what is left of fp as one artifact: "TAG length", then the bytes */
+void send_artifact_stream(FILE *out, const char *tag, FILE *fp) {
+    size_t length = 0, n;
+
+    while (server_reserve(length + 4096) &&
+           (n = fread(server_buffer + length, 1, 4096, fp)) > 0) {
+        length += n;
     }
+    fprintf(out, "%s %lu\n", tag, (unsigned long)length);
+    fwrite(server_buffer, 1, length, out);
 }
 
-void generate_extra_operand_words(void) {
-    InstructionNode *cur;
-    Symbol *sym;
-    MemoryWord temp[MAX_MEMORY];
-    int extra, i, k, new_cnt;
-    char buf1[MAX_LINE_LENGTH];
-    char buf2[MAX_LINE_LENGTH];
-    char *tok1, *tok2;
-    char *ops1[2];
-    char *ops2[2];
-    int m1, m2, modes[2], val;
-
-    /* 1) Count how many extra words are needed */
-    extra = 0;
-    cur = instruction_head;
-    while (cur) {
-        /* tokenize operands */
-        strncpy(buf1, cur->line, MAX_LINE_LENGTH);
-        buf1[MAX_LINE_LENGTH-1] = '\0';
-        tok1 = strtok(buf1, " \t\n");      /* skip opcode */
-        ops1[0] = strtok(NULL, ", \t\n");
-        ops1[1] = strtok(NULL, ", \t\n");
-
-        m1 = ops1[0] ? detect_addressing_mode(ops1[0]) : -1;
-        m2 = ops1[1] ? detect_addressing_mode(ops1[1]) : -1;
-        if (m1 == 3 && m2 == 3) {
-            extra += 1;
-        } else {
-            if (m1 >= 0) extra++;
-            if (m2 >= 0) extra++;
-        }
-        cur = cur->next;
+bool assemble_stream(FILE *in, const char *name, const char *base, FILE *artifacts);
+
+/* Assembles one source straight from server_buffer and sends back its artifacts. Nothing
+   is written to disk; what lasts between requests is the process and the tables it keeps,
+   such as the interned name arena. */
+void serve_request(FILE *out, const char *name, size_t length) {
+    char src[MAX_LINE_LENGTH + 4];
+    FILE *source, *log, *artifacts;
+    char *data = NULL;
+    size_t size = 0;
+    int saved_out, saved_err;
+
+    if ((size_t)snprintf(src, sizeof(src), "%s.as", name) >= sizeof(src)) {
+        fprintf(out, "ERR name %.20s... is too long\n", name);
+        return;
+    }
+    source    = length ? fmemopen(server_buffer, length, "r") : fopen("/dev/null", "r");
+    log       = tmpfile();
+    artifacts = open_memstream(&data, &size);
+    if (!source || !log || !artifacts) {
+        if (source) fclose(source);
+        if (log) fclose(log);
+        if (artifacts) fclose(artifacts);
+        free(data);
+        fprintf(out, "ERR cannot set up %s\n", src);
+        return;
     }
 
-    /* 2) Shift data symbol addresses */
-    for (sym = symbol_table_head; sym; sym = sym->next) {
-        if (sym->is_data) {
-            sym->address += extra;
-        }
+    /* everything the assembler prints goes to the request's log */
+    fflush(stdout);
+    fflush(stderr);
+    saved_out = dup(1);
+    saved_err = dup(2);
+    dup2(fileno(log), 1);
+    dup2(fileno(log), 2);
+
+    assemble_stream(source, src, NULL, artifacts);     /* starts with reset_assembler_state() */
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, 1);
+    dup2(saved_err, 2);
+    close(saved_out);
+    close(saved_err);
+    fclose(source);
+
+    fprintf(out, "OK %s\n", name);
+    rewind(log);
+    send_artifact_stream(out, "LOG", log);
+    fclose(log);
+    fclose(artifacts);
+    if (size > 0) {
+        fwrite(data, 1, size, out);
+    } else {
+        fprintf(out, "OB 0\nENT 0\nEXT 0\n");     /* the source was too broken for an image */
     }
-    /* Shift existing data words in memory[] */
-    for (i = 100; i < memory_counter; i++) {
-        if (!memory[i].is_code) {
-            memory[i].address += extra;
+    free(data);
+    fprintf(out, "END\n");
+    fflush(out);
+}
+
+/* Serves requests from one stream until EOF (returns true) or QUIT (returns false) */
+bool serve_stream(FILE *in, FILE *out) {
+    char header[MAX_LINE_LENGTH * 2];
+    char name[MAX_LINE_LENGTH];
+    unsigned long length;
+    int end = 0;
+    bool too_long;
+    char *p;
+
+    while (fgets(header, sizeof(header), in)) {
+        if (strncmp(header, "QUIT", 4) == 0) {
+            return false;
+        }
+        if (sscanf(header, "ASSEMBLE %80s%n", name, &end) != 1) {
+            fprintf(out, "ERR bad request\n");
+            fflush(out);
+            continue;
+        }
+        /* a longer name is skipped, its source is still read so the stream stays in step */
+        too_long = header[end] && !isspace((unsigned char)header[end]);
+        while (header[end] && !isspace((unsigned char)header[end])) end++;
+        if (sscanf(header + end, "%lu", &length) != 1) {
+            fprintf(out, "ERR bad request\n");
+            fflush(out);
+            continue;
+        }
+        /* the name only labels the diagnostics */
+        for (p = name; *p; p++) {
+            if (!isalnum((unsigned char)*p) && *p != '_' && *p != '-') *p = '_';
+        }
+        if (!server_reserve(length + 1) || fread(server_buffer, 1, length, in) != length) {
+            fprintf(out, "ERR cannot read %lu bytes of source\n", length);
+            fflush(out);
+            return true;
         }
+        if (too_long) {
+            fprintf(out, "ERR name is longer than %d characters\n", MAX_LINE_LENGTH - 1);
+            fflush(out);
+            continue;
+        }
+        serve_request(out, name, length);
     }
+    return true;
+}
 
-    /* 3) Backup old memory */
-    memcpy(temp, memory, sizeof(memory));
+/* Runs the server on stdin/stdout, or on a Unix socket when socket_path is given */
+int run_server(const char *socket_path) {
+    struct sockaddr_un addr;
+    FILE *in, *out;
+    int listen_fd, fd;
+    bool running = true;
+
+    if (!socket_path) {
+        /* responses go to the real stdout, anything else printed goes to stderr */
+        out = fdopen(dup(1), "w");
+        dup2(2, 1);
+        if (!out) return 1;
+        serve_stream(stdin, out);
+        fclose(out);
+        return 0;
+    }
 
-    /* 4) Rebuild code words with extra operand words */
-    new_cnt = 100;
-    cur     = instruction_head;
-    while (cur) {
-        /* copy primary instruction word */
-        memory[new_cnt]         = temp[cur->address];
-        memory[new_cnt].address = new_cnt;
-        new_cnt++;
-
-        /* parse operands again */
-        strncpy(buf2, cur->line, MAX_LINE_LENGTH);
-        buf2[MAX_LINE_LENGTH-1] = '\0';
-        tok2     = strtok(buf2, " \t\n");  /* skip opcode */
-        ops2[0]  = strtok(NULL, ", \t\n");
-        ops2[1]  = strtok(NULL, ", \t\n");
-        modes[0] = ops2[0] ? detect_addressing_mode(ops2[0]) : -1;
-        modes[1] = ops2[1] ? detect_addressing_mode(ops2[1]) : -1;
-
-        /* if both operands are registers, pack into one word */
-        if (modes[0] == 3 && modes[1] == 3) {
-            int r1 = ops2[0][1] - '0';
-            int r2 = ops2[1][1] - '0';
-            memory[new_cnt].address = new_cnt;
-            memory[new_cnt].value   = (r1 << 4) | r2;
-            memory[new_cnt].is_code = 1;
-            new_cnt++;
-        } else {
-            /* otherwise generate one word per operand */
-            for (k = 0; k < 2; k++) {
-                if (modes[k] < 0) continue;
-                if (modes[k] == 0) {           /* immediate */
-                    val = atoi(ops2[k] + 1);
-                } else if (modes[k] == 1) {    /* direct */
-                    sym = find_symbol(ops2[k]);
-                    val = sym ? sym->address : 0;
-                } else if (modes[k] == 2) {    /* index */
-                    char lbl[MAX_LINE_LENGTH];
-                    int reg;
-                    sscanf(ops2[k], "%[^[][%*c%d%*c]", lbl, &reg);
-                    sym = find_symbol(lbl);
-                    /* write base address word */
-                    memory[new_cnt].address = new_cnt;
-                    memory[new_cnt].value   = sym ? sym->address : 0;
-                    memory[new_cnt].is_code = 1;
-                    new_cnt++;
-                    val = reg;
-                } else {                       /* single register */
-                    val = ops2[k][1] - '0';
-                }
-                memory[new_cnt].address = new_cnt;
-                memory[new_cnt].value   = val;
-                memory[new_cnt].is_code = 1;
-                new_cnt++;
-            }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 8) != 0) {
+        fprintf(stderr, "Error: cannot listen on %s\n", socket_path);
+        return 1;
+    }
+
+    /* one client at a time; a QUIT from any client stops the server */
+    while (running && (fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        in  = fdopen(fd, "r");
+        out = fdopen(dup(fd), "w");
+        if (in && out) {
+            running = serve_stream(in, out);
         }
-        cur = cur->next;
+        if (in) fclose(in);
+        if (out) fclose(out);
     }
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
 
-    /* 5) Append data words after code */
-    for (i = 100; i < memory_counter; i++) {
-        if (!temp[i].is_code) {
-            memory[new_cnt]         = temp[i];
-            memory[new_cnt].address = new_cnt;
-            new_cnt++;
+
+/* ---- Watch mode: reassembles sources when they change on disk ---- */
+
+/* Source lines of the file whose tables are currently loaded, as first read by fgets */
+char (*watch_lines)[MAX_LINE_LENGTH] = NULL;
+int watch_line_count = 0;
+char watch_loaded[FILENAME_MAX] = "";
+
+/* Reads a source the way the pipeline does (fgets chunks), returns the line count or -1 */
+int read_source_lines(const char *src, char (**lines)[MAX_LINE_LENGTH]) {
+    FILE *fp = fopen(src, "r");
+    char (*buf)[MAX_LINE_LENGTH] = NULL, (*bigger)[MAX_LINE_LENGTH];
+    int count = 0, size = 0;
+
+    if (!fp) return -1;
+    for (;;) {
+        if (count == size) {
+            size = size ? size * 2 : 256;
+            bigger = realloc(buf, sizeof(*buf) * size);
+            if (!bigger) {
+                free(buf);
+                fclose(fp);
+                return -1;
+            }
+            buf = bigger;
         }
+        if (!fgets(buf[count], MAX_LINE_LENGTH, fp)) break;
+        count++;
     }
+    fclose(fp);
+    *lines = buf;
+    return count;
+}
 
-    /* 6) Update counter */
-    memory_counter = new_cnt;
+/* Normalizes one source line like the first two pipeline stages (with its newline) */
+void normalize_line(const char *line, char *out) {
+    char spaced[MAX_LINE_LENGTH];
+    collapse_spaces(line, spaced);
+    strip_comma_spaces(spaced, out);
+    strcat(out, "\n");
 }
 
+/* One changed instruction line found by reassemble_incrementally */
+typedef struct {
+    InstructionNode *node;
+    int old_address;
+    int old_length;
+    int new_length;
+    char line[MAX_LINE_LENGTH];     /* new text, without its label */
+} LinePatch;
+
+#define MAX_LINE_PATCHES 256
+
+LinePatch line_patches[MAX_LINE_PATCHES];
+int patch_shift[MAX_LINE_PATCHES + 1];     /* prefix sums: size change of patches [0, i) */
+
+/* How far an old address moves: the size change of every patch placed before it */
+int shifted_address(int address, int count) {
+    int lo = 0, hi = count;
+    /* find the number of patches that start before address */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (line_patches[mid].old_address < address) lo = mid + 1;
+        else hi = mid;
+    }
+    return address + patch_shift[lo];
+}
 
+/* Applies the patches to the image: later words, labels, external uses and fixups move by
+   the prefix sum of the size changes before them, and the patched lines are re-encoded */
+void apply_line_patches(int count) {
+    static Word temp[MAX_MEMORY];
+    InstructionNode *node;
+    ExternalUse *use;
+    Symbol *sym;
+    Fixup *fixup;
+    int i, addr, shift, old_counter = memory_counter;
+    bool moved;
+
+    /* 1) forget what the old lines recorded */
+    for (i = 0; i < count; i++) {
+        remove_external_uses(line_patches[i].old_address,
+                             line_patches[i].old_address + line_patches[i].old_length);
+        remove_fixups(line_patches[i].old_address,
+                      line_patches[i].old_address + line_patches[i].old_length);
+    }
 
-/* Goes over the file again and handles .entry lines */
-void mark_entries(FILE *fp) {
-    char line[MAX_LINE_LENGTH];
-    char *line_ptr;
-    int line_number = 0;
+    for (i = 0; i < count && line_patches[i].new_length == line_patches[i].old_length; i++)
+        ;
+    moved = i < count;
 
-    rewind(fp);  /* Start reading the file from the beginning */
+    /* 2) move addresses */
+    if (moved) {
+        for (sym = symbol_table_head; sym; sym = sym->next) {
+            if (!sym->is_external && sym->address >= 100) {
+                sym->address = shifted_address(sym->address, count);
+            }
+        }
+        for (node = instruction_head; node; node = node->next) {
+            node->address = shifted_address(node->address, count);
+        }
+        for (use = external_use_head; use; use = use->next) {
+            use->address = shifted_address(use->address, count);
+        }
+        for (fixup = fixup_head; fixup; fixup = fixup->next) {
+            fixup->address = shifted_address(fixup->address, count);
+        }
 
-    while (fgets(line, MAX_LINE_LENGTH, fp)) {
-        line_number++;
+        /* 3) move the words themselves, skipping the old text of patched lines */
+        memcpy(temp, memory, sizeof(Word) * old_counter);
+        shift = 0;
+        i = 0;
+        for (addr = 100; addr < old_counter; addr++) {
+            if (i < count && addr == line_patches[i].old_address) {
+                addr += line_patches[i].old_length - 1;
+                shift += line_patches[i].new_length - line_patches[i].old_length;
+                i++;
+                continue;
+            }
+            memory[addr + shift] = temp[addr];
+        }
+        memory_counter = old_counter + patch_shift[count];
+        data_start    += patch_shift[count];
 
-        /* Skip empty lines or comment lines */
-        if (line[0] == '\n' || line[0] == ';') {
-            continue;
+        /* 4) words holding label addresses get the new addresses */
+        for (fixup = fixup_head; fixup; fixup = fixup->next) {
+            if (fixup->symbol) memory[fixup->address] = (Word)fixup->symbol->address;
         }
+    }
 
-        line_ptr = line;
+    /* 5) re-encode the patched lines at their new place */
+    for (i = 0; i < count; i++) {
+        node = line_patches[i].node;
+        node->line   = intern_line(line_patches[i].line);
+        node->length = line_patches[i].new_length;
+        memory[node->address] = (Word)encode_instruction(node->line);
+        emit_operand_words(node->line, node->address + 1, node->line_number);
+    }
 
-        /* Skip spaces at the beginning of the line */
-        while (isspace(*line_ptr)) {
-            line_ptr++;
-        }
+    /* 6) expressions may use labels that moved */
+    resolve_expressions();
+}
 
-        /* Check if the line has a .entry directive */
-        if (strncmp(line_ptr, ".entry", 6) == 0 || strstr(line_ptr, ".entry") != NULL) {
-            char label_name[MAX_LINE_LENGTH];
-            Symbol *curr = symbol_table_head;
-            bool found = false;
+/* Finds the lines that changed since src was last assembled and re-encodes only those.
+   Changed lines must stay instructions, keep any label they had, and not involve macros;
+   their size may change. Returns false (without touching anything) when a full reassembly
+   is needed. */
+bool reassemble_incrementally(const char *src, char (*lines)[MAX_LINE_LENGTH], int count,
+                              int *patched) {
+    char old_norm[MAX_LINE_LENGTH], new_norm[MAX_LINE_LENGTH];
+    char old_label[MAX_LINE_LENGTH], new_label[MAX_LINE_LENGTH];
+    InstructionNode *node = instruction_head;
+    LinePatch *patch;
+    Macro *macro;
+    int i, n = 0, am_line = 0;
+    bool in_macro = false, valid;
+    const char *p, *instr;
+
+    /* a file with errors is rebuilt in full so its diagnostics are reported again, and so
+       is an -O image: a changed line can make the peephole pass remove other instructions */
+    if (strcmp(src, watch_loaded) != 0 || count != watch_line_count || error_count > 0 ||
+        opt_optimize) {
+        return false;
+    }
 
-            /* Move pointer past the ".entry" part */
-            line_ptr = strstr(line_ptr, ".entry");
-            line_ptr += 6;
+    for (i = 0; i < count; i++) {
+        bool changed = strcmp(lines[i], watch_lines[i]) != 0;
+        normalize_line(watch_lines[i], old_norm);
+
+        /* macro definitions are stripped before the .am file, and must stay as they are */
+        /* an included file stands for any number of .am lines */
+        if (strncmp(old_norm, ".include ", 9) == 0) return false;
+        if (in_macro || strncmp(old_norm, "macro ", 6) == 0) {
+            if (changed) return false;
+            if (in_macro && strncmp(old_norm, "endmacro", 8) == 0) in_macro = false;
+            else if (!in_macro) in_macro = true;
+            continue;
+        }
 
-            /* Skip spaces before the label name */
-            while (isspace(*line_ptr)) {
-                line_ptr++;
+        macro = match_macro(old_norm);
+        if (macro) {
+            if (changed) return false;
+            for (p = macro->content; *p; p++) {
+                if (*p == '\n') am_line++;
             }
+            continue;
+        }
+        am_line++;
+        if (!changed) continue;
 
-            /* Get the label name */
-            sscanf(line_ptr, "%s", label_name);
+        normalize_line(lines[i], new_norm);
+        if ((old_norm[0] == '\n' || old_norm[0] == ';') &&
+            (new_norm[0] == '\n' || new_norm[0] == ';')) {
+            continue;           /* blank or comment either way */
+        }
+        if (!is_instruction(old_norm) || is_directive(old_norm) ||
+            !is_instruction(new_norm) || is_directive(new_norm) ||
+            strncmp(new_norm, "macro ", 6) == 0 || strncmp(new_norm, ".include ", 9) == 0 || match_macro(new_norm) ||
+            n == MAX_LINE_PATCHES) {
+            return false;
+        }
 
-            /* Go through the symbol table and search for that label */
-            while (curr != NULL) {
-                if (strcmp(curr->name, label_name) == 0) {
-                    curr->is_entry = 1;  /* Mark this symbol as entry */
-                    found = true;
-                    break;
-                }
-                curr = curr->next;
-            }
+        /* the label layout must not change */
+        old_label[0] = new_label[0] = '\0';
+        if (is_label(old_norm)) sscanf(old_norm, "%[^:]:", old_label);
+        if (is_label(new_norm)) sscanf(new_norm, "%[^:]:", new_label);
+        if (strcmp(old_label, new_label) != 0) {
+            return false;
+        }
+        instr = new_label[0] ? strchr(new_norm, ':') + 1 : new_norm;
+        while (isspace((unsigned char)*instr)) instr++;
 
-            /* If not found, print error message */
-            if (!found) {
-                printf("Error: entry label '%s' not found in symbol table (line %d).\n", label_name, line_number);
-            }
+        /* lines only move forward, so the node search does too */
+        while (node && node->line_number < am_line) node = node->next;
+        if (!node || node->line_number != am_line) {
+            return false;
+        }
+        diagnostics_muted = true;       /* the full rebuild reports what is wrong */
+        valid = validate_instruction(instr, am_line, (int)(instr - new_norm) + 1);
+        diagnostics_muted = false;
+        if (!valid) {
+            return false;
         }
+        patch = &line_patches[n++];
+        patch->node        = node;
+        patch->old_address = node->address;
+        patch->old_length  = node->length;
+        patch->new_length  = instruction_length(instr);
+        strncpy(patch->line, instr, MAX_LINE_LENGTH);
+        patch->line[MAX_LINE_LENGTH - 1] = '\0';
+    }
+
+    patch_shift[0] = 0;
+    for (i = 0; i < n; i++) {
+        patch_shift[i + 1] = patch_shift[i] + line_patches[i].new_length - line_patches[i].old_length;
+    }
+    if (memory_counter + bss_size + patch_shift[n] > MAX_MEMORY) {
+        return false;
     }
+
+    apply_line_patches(n);
+    create_entry_file(src);
+    write_ext_file(src);
+    create_ob_file(src);
+    *patched = n;
+    return true;
 }
 
-/* Creates the .ent file and writes all entry labels */
-void create_entry_file(const char *original_filename) {
-    FILE *ent_fp;
-    char ent_filename[FILENAME_MAX];
-    Symbol *curr = symbol_table_head;
+/* Brings the artifacts of src up to date, incrementally when possible */
+void watch_update(const char *src) {
+    char (*lines)[MAX_LINE_LENGTH] = NULL;
+    struct timespec start, end;
+    int count, patched = 0;
+    double ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = read_source_lines(src, &lines);
+    if (count < 0) {
+        fprintf(stderr, "Error: cannot read %s\n", src);
+        return;
+    }
 
-    /* Create new filename by replacing .as with .ent */
-    strncpy(ent_filename, original_filename, FILENAME_MAX);
-    ent_filename[FILENAME_MAX - 1] = '\0';
-    char *dot = strrchr(ent_filename, '.');
-    if (dot != NULL) {
-        strcpy(dot, ".ent");
+    if (!reassemble_incrementally(src, lines, count, &patched)) {
+        assemble_file(src);
+        strncpy(watch_loaded, src, FILENAME_MAX);
+        watch_loaded[FILENAME_MAX - 1] = '\0';
+        patched = -1;
+    }
+    /* the new text is what the next change is compared with */
+    free(watch_lines);
+    watch_lines = lines;
+    watch_line_count = count;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    if (patched >= 0) {
+        printf("%s: re-encoded %d line(s) in %.3f ms\n", src, patched, ms);
     } else {
-        strcat(ent_filename, ".ent");
+        printf("%s: reassembled in %.3f ms\n", src, ms);
     }
+    fflush(stdout);
+}
 
-    /* Open the file for writing */
-    ent_fp = fopen(ent_filename, "w");
-    if (!ent_fp) {
-        printf("Error: could not create %s file.\n", ent_filename);
-        return;
+/* Assembles the sources, then watches their directories and updates them as they change */
+int run_watch(char *sources[], int count) {
+#ifdef __linux__
+    char events[4096];
+    char dir[FILENAME_MAX];
+    const char *base;
+    int *wds = malloc(sizeof(int) * (count > 0 ? count : 1));
+    int fd, i, len, offset;
+    struct inotify_event *event;
+
+    fd = inotify_init();
+    if (fd < 0 || !wds) {
+        fprintf(stderr, "Error: cannot start inotify\n");
+        free(wds);
+        return 1;
     }
+    opt_dump = DUMP_NONE;   /* incremental updates would not be dumped, so none are */
 
-    /* Write all entry symbols to the file */
-    while (curr != NULL) {
-        if (curr->is_entry) {
-            fprintf(ent_fp, "%s %03d\n", curr->name, curr->address);
+    for (i = 0; i < count; i++) {
+        /* watch the directory, editors often replace the file instead of writing it */
+        base = strrchr(sources[i], '/');
+        if (base) {
+            sprintf(dir, "%.*s", (int)(base - sources[i]) ? (int)(base - sources[i]) : 1, sources[i]);
+        } else {
+            strcpy(dir, ".");
         }
-        curr = curr->next;
+        wds[i] = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wds[i] < 0) {
+            fprintf(stderr, "Error: cannot watch %s\n", dir);
+        }
+        watch_update(sources[i]);
     }
 
-    fclose(ent_fp);
+    while ((len = read(fd, events, sizeof(events))) > 0) {
+        for (offset = 0; offset < len; offset += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)(events + offset);
+            if (!event->len) continue;
+            for (i = 0; i < count; i++) {
+                base = strrchr(sources[i], '/');
+                base = base ? base + 1 : sources[i];
+                if (event->wd == wds[i] && strcmp(event->name, base) == 0) {
+                    watch_update(sources[i]);
+                }
+            }
+        }
+    }
+    free(wds);
+    close(fd);
+    return 0;
+#else
+    (void)sources;
+    (void)count;
+    fprintf(stderr, "Error: watch mode needs inotify (Linux)\n");
+    return 1;
+#endif
 }
 
-/* Writes the .ext file that lists where external labels were used */
-void write_ext_file(const char *filename) {
-    InstructionNode *curr_instr = instruction_head;
-    FILE *ext_file;
-    char ext_filename[FILENAME_MAX];
-    char *opcode, *operand1, *operand2;
-    char line_copy[MAX_LINE_LENGTH];
-    int addr;
+/* ---- Streaming: one source read from stdin or a pipe in a single forward pass ---- */
 
-    /* Generate the file name with .ext extension */
-    strcpy(ext_filename, filename);
-    strcat(ext_filename, ".ext");
+/* A .entry line kept until the end of input, it may name a label defined further down */
+typedef struct PendingEntry {
+    const char *line;       /* interned */
+    int line_number;
+    struct PendingEntry *next;
+} PendingEntry;
 
-    ext_file = fopen(ext_filename, "w");
-    if (!ext_file) {
-        printf("Error: could not create %s\n", ext_filename);
+/* Writes one artifact of the image to out, framed as "TAG length" like server replies */
+void send_stream_artifact(FILE *out, const char *tag, void (*write)(FILE *)) {
+    FILE *tmp = tmpfile();
+    if (!tmp) {
+        report_error(0, 0, "io", "cannot create a temporary file for %s", tag);
         return;
     }
+    write(tmp);
+    rewind(tmp);
+    send_artifact_stream(out, tag, tmp);
+    fclose(tmp);
+}
+
+/* Runs one line of a streamed source through the first pass: a macro use stands for its
+   lines, all reported at the line of the use. context is the tail of the .entry list. */
+void stream_statement(const char *line, int line_number, void *context) {
+    char raw[MAX_LINE_LENGTH + 2];
+    char expansion[MAX_LINE_LENGTH * 20];
+    PendingEntry ***pending_tail = (PendingEntry ***)context, *entry;
+    const char *p, *eol;
+
+    p = expand_macro_line(line, line_number, expansion, sizeof(expansion)) ? expansion : line;
+    for (; *p; p = *eol ? eol + 1 : eol) {
+        size_t length;
+        eol = strchr(p, '\n');
+        if (!eol) eol = p + strlen(p);
+        length = (size_t)(eol - p) < MAX_LINE_LENGTH ? (size_t)(eol - p) : MAX_LINE_LENGTH;
+        memcpy(raw, p, length);
+        raw[length]     = '\n';
+        raw[length + 1] = '\0';
+
+        first_pass_line(raw, line_number);
+        if (is_entry_line(raw)) {
+            entry = malloc(sizeof(PendingEntry));
+            if (!entry) {
+                report_error(line_number, 0, "alloc", "memory allocation failed for .entry");
+                continue;
+            }
+            entry->line        = intern_line(raw);
+            entry->line_number = line_number;
+            entry->next        = NULL;
+            **pending_tail = entry;
+            *pending_tail  = &entry->next;
+        }
+    }
+}
 
-    while (curr_instr != NULL) {
-        /* Make a copy of the line to tokenize */
-        strncpy(line_copy, curr_instr->line, MAX_LINE_LENGTH);
-        line_copy[MAX_LINE_LENGTH - 1] = '\0';
+void queue_outputs(const char *base);
+
+/* Assembles the source read from in without rewinding it. Each line is normalized,
+   macros are collected and expanded as they arrive, and the line goes through the first
+   pass right away; .entry lines wait for the end of input. Operand words are generated
+   once the input ends, when every forward reference is known, and local label words get
+   their fixups as usual. The outputs are BASE.ob/.ent/.ext, or the OB, ENT and EXT
+   artifacts on the artifacts stream when base is NULL; the batch driver writes them in the
+   background. Returns false when the source had errors. */
+bool assemble_stream(FILE *in, const char *name, const char *base, FILE *artifacts) {
+    char raw[MAX_LINE_LENGTH + 2], line[MAX_LINE_LENGTH + 2];   /* a full line plus '\n' */
+    char macro_name[MAX_LINE_LENGTH];
+    char macro_content[MAX_LINE_LENGTH * 10];
+    char params[MAX_MACRO_PARAMS][MAX_LINE_LENGTH];
+    PendingEntry *pending = NULL, **pending_tail = &pending, *entry;
+    int line_number = 0, param_count = 0;
+    bool in_macro = false;
 
-        opcode = strtok(line_copy, " \t\n");
-        operand1 = strtok(NULL, ", \t\n");
-        operand2 = strtok(NULL, ", \t\n");
+    reset_assembler_state();
+    begin_diagnostics(name);
+    clear_data_pool();
 
-        addr = curr_instr->address;
+    while (!error_limit_reached() && fgets(raw, MAX_LINE_LENGTH, in)) {
+        line_number++;
+        normalize_line(raw, line);
 
-        /* Check if operand1 is an external label */
-        if (operand1 != NULL) {
-            Symbol *sym = symbol_table_head;
-            while (sym) {
-                if (sym->is_external && strcmp(sym->name, operand1) == 0) {
-                    fprintf(ext_file, "%s %d\n", operand1, addr);
-                }
-                sym = sym->next;
+        /* macro definitions */
+        if (in_macro) {
+            if (strncmp(line, "endmacro", 8) == 0) {
+                in_macro = false;
+                if (param_count >= 0) add_macro(macro_name, macro_content, params, param_count);
+            } else if (strlen(macro_content) + strlen(line) < sizeof(macro_content)) {
+                strcat(macro_content, line);
+            } else {
+                report_error(line_number, 1, "macro", "macro '%s' is too long", macro_name);
+            }
+            continue;
+        }
+        if (strncmp(line, "macro ", 6) == 0) {
+            param_count = parse_macro_header(line, line_number, macro_name, params);
+            if (param_count >= 0 && macro_exists(macro_name)) {
+                report_error(line_number, 7, "macro", "duplicate macro '%s'", macro_name);
+                param_count = -1;
             }
+            in_macro = true;
+            macro_content[0] = '\0';
+            continue;
         }
 
-        /* Check if operand2 is an external label */
-        if (operand2 != NULL) {
-            Symbol *sym = symbol_table_head;
-            while (sym) {
-                if (sym->is_external && strcmp(sym->name, operand2) == 0) {
-                    fprintf(ext_file, "%s %d\n", operand2, addr);
-                }
-                sym = sym->next;
-            }
+        if (strncmp(line, ".include ", 9) == 0) {
+            include_file(name, line, line_number, stream_statement, &pending_tail);
+            continue;
         }
+        stream_statement(line, line_number, &pending_tail);
+    }
+    if (in_macro) {
+        report_error(0, 0, "macro", "missing endmacro for '%s'", macro_name);
+    }
 
-        curr_instr = curr_instr->next;
+    for (entry = pending; entry; entry = pending) {
+        if (!error_limit_reached()) {
+            mark_entry_line(entry->line, entry->line_number);
+        }
+        pending = entry->next;
+        free(entry);
     }
 
-    fclose(ext_file);
-}
+    if (error_limit_reached() || (opt_fail_fast && error_count > 0)) {
+        /* like assemble_file, a batch leaves no outputs of a broken source behind */
+        if (base && opt_batch_io != BATCH_NONE && !opt_archive) remove_outputs(base);
+        return finish_diagnostics();
+    }
+    build_image(name, !base && artifacts == stdout ? stderr : stdout);    /* keep artifacts apart */
 
-/* Convert a 12-bit word into 5 “base-4” chars: a=00, b=01, c=10, d=11 */
-void word_to_base4(int word, char out[6]) {
-    int i;
-    /* We only encode the lower 12 bits: bits 0–11 */
-    /* We split into 5 groups of 2 bits each: group 0 = bits 8–9, ..., group 4 = bits 0–1 */
-    for (i = 0; i < 5; i++) {
-        int shift = (4 - i) * 2;
-        int two_bits = (word >> shift) & 0x3; /* extract 2 bits */
-        /* map 0→'a', 1→'b', 2→'c', 3→'d' */
-        out[i] = (char)('a' + two_bits);
+    if (base && (opt_batch_io != BATCH_NONE || opt_archive)) {
+        queue_outputs(base);
+        if (opt_dump != DUMP_NONE) {
+            write_dump(base);
+        }
+    } else if (base) {
+        create_entry_file(base);
+        write_ext_file(base);
+        create_ob_file(base);
+        if (opt_dump != DUMP_NONE) {
+            write_dump(base);
+        }
+    } else {
+        send_stream_artifact(artifacts, "OB", write_object);
+        send_stream_artifact(artifacts, "ENT", write_entries);
+        send_stream_artifact(artifacts, "EXT", write_externals);
+        fflush(artifacts);
     }
-    out[5] = '\0';
+    return finish_diagnostics();
 }
 
 
-/* Creates the .ob file containing the memory image (code + data) */
-void create_ob_file(const char *original_filename) {
-    FILE *ob_fp;
-    char ob_filename[FILENAME_MAX];
-    int i, instruction_count = 0, data_count = 0;
-    char base4[6];
+/* ---- Batch I/O: sources are read ahead of the assembler and outputs written behind it ---- */
 
-    /* Count instructions and data */
-    for (i = 100; i < memory_counter; i++) {
-        if (memory[i].is_code)
-            instruction_count++;
-        else
-            data_count++;
-    }
+#define BATCH_PREFETCH 8            /* sources read ahead of the one being assembled */
+#define BATCH_RING_ENTRIES 64       /* requests in flight at most */
 
-    /* Construct .ob filename */
-    strncpy(ob_filename, original_filename, FILENAME_MAX);
-    ob_filename[FILENAME_MAX - 1] = '\0';
-    {
-        char *dot = strrchr(ob_filename, '.');
-        if (dot) strcpy(dot, ".ob");
-        else    strcat(ob_filename, ".ob");
+/* A source being read, or an output being written, in one piece */
+typedef struct {
+    char path[FILENAME_MAX];
+    char *data;
+    size_t size;
+    size_t done;                    /* bytes transferred so far */
+    int fd;
+    bool writing;                   /* an output, freed once written */
+    bool pending;                   /* a request is in flight */
+    bool failed;
+} BatchFile;
+
+int batch_in_flight = 0;
+
+void finish_batch_file(BatchFile *file) {
+    if (file->fd >= 0) close(file->fd);
+    file->fd = -1;
+    if (!file->writing) return;
+    if (file->failed) {
+        fprintf(stderr, "Error: could not write %s\n", file->path);
+        total_errors++;
     }
+    free(file->data);
+    free(file);
+}
 
-    ob_fp = fopen(ob_filename, "w");
-    if (!ob_fp) {
-        fprintf(stderr, "Error: could not create %s file.\n", ob_filename);
-        return;
+/* Reads or writes what is left of file with pread/pwrite: the portable path, and the one
+   for requests the ring could not do */
+void transfer_sync(BatchFile *file) {
+    ssize_t n;
+    while (file->done < file->size) {
+        if (file->writing) {
+            n = pwrite(file->fd, file->data + file->done, file->size - file->done, (off_t)file->done);
+        } else {
+            n = pread(file->fd, file->data + file->done, file->size - file->done, (off_t)file->done);
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || (n == 0 && file->writing)) {
+            file->failed = true;
+            break;
+        }
+        if (n == 0) {
+            file->size = file->done;    /* the source shrank since fstat */
+            break;
+        }
+        file->done += (size_t)n;
     }
+    finish_batch_file(file);
+}
 
-    /* Header: code words count and data words count */
-    fprintf(ob_fp, "%d %d\n", instruction_count, data_count);
+#ifdef HAVE_IO_URING
+long syscall(long number, ...);
 
-    /* Write each memory word in base-4 encoding */
-    for (i = 100; i < memory_counter; i++) {
-        word_to_base4(memory[i].value, base4);
-        fprintf(ob_fp, "%03d %s\n", memory[i].address, base4);
+/* An io_uring instance: submission and completion rings shared with the kernel */
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned unsubmitted;           /* queued since the last io_uring_enter */
+    BatchFile *requests[BATCH_RING_ENTRIES];    /* queued or in flight, batch_in_flight of them */
+} IoRing;
+
+IoRing batch_ring;
+bool batch_ring_open = false;
+
+/* Sets up the ring; false where io_uring is missing or not allowed */
+bool open_ring(void) {
+    struct io_uring_params params;
+    IoRing *ring = &batch_ring;
+    char *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, BATCH_RING_ENTRIES, &params);
+    if (ring->fd < 0) return false;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size   = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes   = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || (void *)ring->sqes == MAP_FAILED) {
+        if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+        if (ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+        if ((void *)ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        return false;
     }
 
-    fclose(ob_fp);
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->unsubmitted = 0;
+    batch_ring_open = true;
+    return true;
 }
 
-
-/* Perform the second pass: mark .entry labels, and write .ent, .ext and .ob files */
-void second_pass(FILE *fp, const char *orig_filename) {
-    rewind(fp);
-    mark_entries(fp);
-    generate_extra_operand_words();
-    create_entry_file(orig_filename);
-    write_ext_file(orig_filename);
-    create_ob_file(orig_filename);
+void close_ring(void) {
+    if (!batch_ring_open) return;
+    munmap(batch_ring.sqes, batch_ring.sqes_size);
+    munmap(batch_ring.cq_map, batch_ring.cq_map_size);
+    munmap(batch_ring.sq_map, batch_ring.sq_map_size);
+    close(batch_ring.fd);
+    batch_ring_open = false;
 }
 
+/* Queues a read or write of what is left of file; io_uring_enter submits it */
+void ring_queue(BatchFile *file) {
+    IoRing *ring = &batch_ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = file->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd        = file->fd;
+    sqe->addr      = (unsigned long)(file->data + file->done);
+    sqe->len       = (unsigned)(file->size - file->done);
+    sqe->off       = file->done;
+    sqe->user_data = (unsigned long)file;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    ring->requests[batch_in_flight++] = file;
+    file->pending = true;
+}
 
-void print_memory() {
+/* Takes file off the table of requests in flight */
+void ring_forget(BatchFile *file) {
+    IoRing *ring = &batch_ring;
     int i;
+    for (i = 0; i < batch_in_flight; i++) {
+        if (ring->requests[i] == file) {
+            ring->requests[i] = ring->requests[--batch_in_flight];
+            return;
+        }
+    }
+}
 
-    printf("\n--- Memory Content ---\n");
-    for (i = 100; i < memory_counter; i++) {
-        printf("Address: %03d | Value: %d | Type: %s\n",
-               memory[i].address,
-               memory[i].value,
-               memory[i].is_code ? "Code" : "Data");
+/* io_uring_enter failed: closes the ring and finishes every request it held with pread/pwrite,
+   so nothing waits on a completion that will not come */
+void abandon_ring(void) {
+    BatchFile *file;
+    close_ring();
+    while (batch_in_flight > 0) {
+        file = batch_ring.requests[--batch_in_flight];
+        file->pending = false;
+        transfer_sync(file);
     }
 }
 
-void print_symbol_table() {
-    printf("\n--- Symbol Table ---\n");
-    Symbol *curr = symbol_table_head;
-    while (curr) {
-        printf("Label: %s | Address: %03d | Type: %s%s%s\n",
-               curr->name,
-               curr->address,
-               curr->is_external ? "External" : (curr->is_data ? "Data" : "Code"),
-               curr->is_entry ? " | Entry" : "",
-               "");
-        curr = curr->next;
+/* Submits the queued requests and handles the completions that have arrived; with wait,
+   blocks until there is at least one */
+void ring_reap(bool wait) {
+    IoRing *ring = &batch_ring;
+    struct io_uring_cqe *cqe;
+    BatchFile *file;
+    unsigned head, tail;
+    int submitted, result;
+
+    if (!batch_ring_open) return;
+    if (ring->unsubmitted || wait) {
+        submitted = (int)syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait ? 1 : 0,
+                                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted < 0 && errno != EINTR) {
+            abandon_ring();
+            return;
+        }
+        if (submitted > 0) ring->unsubmitted -= (unsigned)submitted;
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe    = &ring->cqes[head & *ring->cq_mask];
+        file   = (BatchFile *)(unsigned long)cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        ring_forget(file);
+        file->pending = false;
+
+        if (result > 0) file->done += (size_t)result;
+        if (result < 0) {
+            transfer_sync(file);        /* e.g. a kernel without IORING_OP_READ */
+        } else if (result > 0 && file->done < file->size) {
+            ring_queue(file);           /* short transfer: the rest */
+        } else {
+            if (result == 0 && !file->writing) file->size = file->done;
+            if (result == 0 && file->writing && file->done < file->size) file->failed = true;
+            finish_batch_file(file);
+        }
+    }
+}
+#else
+bool batch_ring_open = false;
+bool open_ring(void) { return false; }
+void close_ring(void) {}
+void ring_queue(BatchFile *file) { transfer_sync(file); }
+void ring_reap(bool wait) { (void)wait; }
+#endif
+
+/* Starts the transfer of file: on the ring when it is open, otherwise right away */
+void start_transfer(BatchFile *file) {
+    if (file->done == file->size) {
+        finish_batch_file(file);
+    } else if (batch_ring_open) {
+        while (batch_in_flight >= BATCH_RING_ENTRIES) ring_reap(true);
+        ring_queue(file);
+    } else {
+        transfer_sync(file);
     }
 }
 
+/* Opens a source and starts reading all of it */
+void start_read(BatchFile *file, const char *path) {
+    struct stat st;
 
+    strncpy(file->path, path, FILENAME_MAX);
+    file->path[FILENAME_MAX - 1] = '\0';
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0 || fstat(file->fd, &st) != 0 || !(file->data = malloc((size_t)st.st_size + 1))) {
+        file->failed = true;
+        finish_batch_file(file);
+        return;
+    }
+    file->size = (size_t)st.st_size;
+    start_transfer(file);
+}
 
-/* Step 1: Remove extra spaces and tabs, collapse to single spaces */
-void remove_extra_spaces_file(const char *in_filename, const char *out_filename) {
-    FILE *fin = fopen(in_filename, "r");
-    FILE *fout = fopen(out_filename, "w");
-    char line[MAX_LINE_LENGTH];
-    if (!fin || !fout) {
-        fprintf(stderr, "Error: could not open %s or %s for cleaning spaces\n", in_filename, out_filename);
+/* Starts writing the size bytes of data, which the write takes over, to path */
+void start_write(const char *path, char *data, size_t size) {
+    BatchFile *file = calloc(1, sizeof(BatchFile));
+
+    if (!file) {
+        fprintf(stderr, "Error: could not write %s\n", path);
+        total_errors++;
+        free(data);
         return;
     }
-    while (fgets(line, MAX_LINE_LENGTH, fin)) {
-        char buf[MAX_LINE_LENGTH];
-        int r = 0, w = 0;
-        bool in_space = false;
-        /* Trim leading spaces/tabs */
-        while (line[r] && isspace((unsigned char)line[r])) r++;
-        /* Process rest */
-        for (; line[r] && line[r] != '\n'; r++) {
-            if (isspace((unsigned char)line[r])) {
-                if (!in_space) {
-                    buf[w++] = ' ';
-                    in_space = true;
-                }
-            } else {
-                buf[w++] = line[r];
-                in_space = false;
+    strncpy(file->path, path, FILENAME_MAX);
+    file->path[FILENAME_MAX - 1] = '\0';
+    file->data    = data;
+    file->size    = size;
+    file->writing = true;
+    file->fd      = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file->fd < 0) {
+        file->failed = true;
+        finish_batch_file(file);
+        return;
+    }
+    start_transfer(file);
+}
+
+/* ---- Archives: --archive=FILE collects the outputs of a run in one indexed file (archive.h) ---- */
+
+typedef struct {
+    char *name;
+    char *data;
+    size_t size;
+} ArchiveEntry;
+
+ArchiveEntry *archive_entries = NULL;
+int archive_count = 0;
+int archive_capacity = 0;
+
+/* Adds an output to the archive, which takes over data; a later output of the same name
+   replaces the earlier one, as it would replace the file */
+void add_archive_member(const char *name, char *data, size_t size) {
+    ArchiveEntry *grown;
+    int i;
+
+    for (i = 0; i < archive_count && strcmp(archive_entries[i].name, name) != 0; i++)
+        ;
+    if (i < archive_count) {
+        free(archive_entries[i].data);
+    } else {
+        if (archive_count == archive_capacity) {
+            archive_capacity = archive_capacity ? archive_capacity * 2 : 64;
+            grown = realloc(archive_entries, sizeof(ArchiveEntry) * archive_capacity);
+            if (!grown) {
+                report_error(0, 0, "alloc", "memory allocation failed for archive member %s", name);
+                free(data);
+                return;
             }
-            if (w >= MAX_LINE_LENGTH - 1) break;
+            archive_entries = grown;
         }
-        /* Trim trailing space */
-        if (w > 0 && buf[w - 1] == ' ') w--;
-        buf[w] = '\0';
-        fprintf(fout, "%s\n", buf);
+        archive_entries[i].name = malloc(strlen(name) + 1);
+        if (!archive_entries[i].name) {
+            report_error(0, 0, "alloc", "memory allocation failed for archive member %s", name);
+            free(data);
+            return;
+        }
+        strcpy(archive_entries[i].name, name);
+        archive_count++;
     }
-    fclose(fin);
-    fclose(fout);
+    archive_entries[i].data = data;
+    archive_entries[i].size = size;
 }
 
-/* Remove macro definitions (macro ... endmacro) -> .t02 */
-void remove_macro_decls_file(const char *in_filename, const char *out_filename) {
-    FILE *fin = fopen(in_filename, "r");
-    FILE *fout = fopen(out_filename, "w");
-    char line[MAX_LINE_LENGTH];
-    bool in_macro = false;
+int compare_archive_entries(const void *a, const void *b) {
+    return strcmp(((const ArchiveEntry *)a)->name, ((const ArchiveEntry *)b)->name);
+}
 
-    if (!fin || !fout) {
-        fprintf(stderr, "Error: cannot open %s or %s for macro-stripping\n", in_filename, out_filename);
+/* Lays out the collected members as an archive and starts writing it to path */
+void write_archive(const char *path) {
+    ArchiveHeader header;
+    ArchiveMember *index;
+    char *image;
+    size_t size, names, contents;
+    int i;
+
+    qsort(archive_entries, archive_count, sizeof(ArchiveEntry), compare_archive_entries);
+    memcpy(header.magic, ARCHIVE_MAGIC, 4);
+    header.version      = ARCHIVE_VERSION;
+    header.byte_order   = ARCHIVE_BYTE_ORDER;
+    header.member_count = (unsigned int)archive_count;
+    header.index        = sizeof(ArchiveHeader);
+    names = contents = header.index + archive_count * sizeof(ArchiveMember);
+    for (i = 0; i < archive_count; i++) contents += strlen(archive_entries[i].name) + 1;
+    size = contents;
+    for (i = 0; i < archive_count; i++) size += archive_entries[i].size;
+    header.size = (unsigned int)size;
+
+    image = calloc(1, size);
+    if (!image) {
+        fprintf(stderr, "Error: memory allocation failed for archive %s\n", path);
+        total_errors++;
         return;
     }
+    memcpy(image, &header, sizeof(header));
+    index = (ArchiveMember *)(image + header.index);
+    for (i = 0; i < archive_count; i++) {
+        index[i].name = (unsigned int)names;
+        strcpy(image + names, archive_entries[i].name);
+        names += strlen(archive_entries[i].name) + 1;
+        index[i].offset = (unsigned int)contents;
+        index[i].size   = (unsigned int)archive_entries[i].size;
+        memcpy(image + contents, archive_entries[i].data, archive_entries[i].size);
+        contents += archive_entries[i].size;
+
+        free(archive_entries[i].name);
+        free(archive_entries[i].data);
+    }
+    free(archive_entries);
+    archive_entries = NULL;
+    archive_count = archive_capacity = 0;
+    start_write(path, image, size);
+}
 
-    while (fgets(line, MAX_LINE_LENGTH, fin)) {
-        /* start of macro definition? */
-        if (!in_macro && strncmp(line, "macro", 5) == 0) {
-            in_macro = true;
+/* Formats the .ent, .ext and .ob files of base into memory and starts writing them, or
+   adds them to the archive */
+void queue_outputs(const char *base) {
+    static void (*const writers[])(FILE *) = {write_entries, write_externals, write_object};
+    static const char *const extensions[] = {".ent", ".ext", ".ob"};
+    char filename[FILENAME_MAX];
+    char *data;
+    size_t size;
+    FILE *out;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        make_filename(filename, base, extensions[i]);
+        data = NULL;
+        out = open_memstream(&data, &size);
+        if (!out) {
+            report_error(0, 0, "io", "could not create %s", filename);
             continue;
         }
-        /* end of macro definition? */
-        if (in_macro && strncmp(line, "endmacro", 8) == 0) {
-            in_macro = false;
+        writers[i](out);
+        if (fclose(out) != 0) {
+            free(data);
+            report_error(0, 0, "io", "could not create %s", filename);
             continue;
         }
-        /* if not inside a macro definition, write the line */
-        if (!in_macro) {
-            fprintf(fout, "%s", line);
-        }
+        if (opt_archive) add_archive_member(filename, data, size);
+        else start_write(filename, data, size);
     }
-
-    fclose(fin);
-    fclose(fout);
 }
 
-/* Remove spaces immediately before or after commas -> .t01a */
-void remove_spaces_next_to_comma_file(const char *in_filename, const char *out_filename) {
-    FILE *fin = fopen(in_filename, "r");
-    FILE *fout = fopen(out_filename, "w");
-    char line[MAX_LINE_LENGTH];
-    if (!fin || !fout) {
-        fprintf(stderr, "Error: cannot open %s or %s for comma-spacing\n", in_filename, out_filename);
-        return;
+/* Assembles many sources without waiting on the disk: up to BATCH_PREFETCH sources are read
+   ahead while one is assembled, and its outputs are written while the next ones are. Each
+   source goes through assemble_stream from memory, so there are no intermediate files.
+   The transfers use io_uring where the build and the kernel have it, pread/pwrite otherwise.
+   With --archive, the outputs are collected and written as one archive at the end. */
+int run_batch(char *files[], int count) {
+    BatchFile *sources = calloc(count > 0 ? count : 1, sizeof(BatchFile));
+    FILE *in;
+    int i, next = 0;
+
+    if (!sources) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
     }
-    while (fgets(line, MAX_LINE_LENGTH, fin)) {
-        char buf[MAX_LINE_LENGTH];
-        int r = 0, w = 0;
-        char c;
-        while ((c = line[r++]) && c != '\n') {
-            if (c == ' ' && line[r] == ',') continue;
-            if (c == ',' && line[r] == ' ') {
-                buf[w++] = ',';
-                r++;
-                continue;
-            }
-            buf[w++] = c;
+    if (opt_batch_io != BATCH_SYNC) open_ring();     /* --archive alone also batches */
+
+    for (i = 0; i < count; i++) {
+        for (; next < count && next <= i + BATCH_PREFETCH; next++) {
+            if (strcmp(files[next], "-") != 0) start_read(&sources[next], files[next]);
         }
-        buf[w] = '\0';
-        fprintf(fout, "%s\n", buf);
+        ring_reap(false);
+        if (strcmp(files[i], "-") == 0) {
+            assemble_stream(stdin, "<stdin>", opt_output, stdout);
+            continue;
+        }
+        while (sources[i].pending) ring_reap(true);
+
+        in = NULL;
+        if (!sources[i].failed) {
+            in = sources[i].size ? fmemopen(sources[i].data, sources[i].size, "r") : fopen("/dev/null", "r");
+        }
+        if (in) {
+            assemble_stream(in, files[i], files[i], NULL);
+            fclose(in);
+        } else {
+            begin_diagnostics(files[i]);
+            report_error(0, 0, "io", "cannot read %s", files[i]);
+            finish_diagnostics();
+        }
+        free(sources[i].data);
+        sources[i].data = NULL;
     }
-    fclose(fin);
-    fclose(fout);
+
+    if (opt_archive) write_archive(opt_archive);
+    while (batch_in_flight > 0) ring_reap(true);
+    close_ring();
+    free(sources);
+    return total_errors > 0 ? 1 : 0;
 }
 
 
+/* bench.c builds the functions above into the microbenchmarks, without this entry point */
+#ifndef ASSEMBLER_NO_MAIN
 int main(int argc, char *argv[]) {
     int file_index;
-    for (file_index = 1; file_index < argc; file_index++) {
-        const char *src = argv[file_index];
-        FILE *fp;
-        char t01[FILENAME_MAX], t01a[FILENAME_MAX], t02[FILENAME_MAX];
-        char pre[FILENAME_MAX], am[FILENAME_MAX];
-        char *dot;
-
-        /* build intermediate filenames based on src */
-        strncpy(t01, src, FILENAME_MAX);
-        t01[FILENAME_MAX-1] = '\0';
-        dot = strrchr(t01, '.');
-        if (dot) strcpy(dot, ".t01"); else strcat(t01, ".t01");
-
-        strncpy(t01a, t01, FILENAME_MAX);
-        t01a[FILENAME_MAX-1] = '\0';
-        dot = strrchr(t01a, '.');
-        if (dot) strcpy(dot, ".t01a"); else strcat(t01a, ".t01a");
-
-        strncpy(t02, t01a, FILENAME_MAX);
-        t02[FILENAME_MAX-1] = '\0';
-        dot = strrchr(t02, '.');
-        if (dot) strcpy(dot, ".t02"); else strcat(t02, ".t02");
-
-        strncpy(pre, src, FILENAME_MAX);
-        pre[FILENAME_MAX-1] = '\0';
-        dot = strrchr(pre, '.');
-        if (dot) strcpy(dot, ".pre"); else strcat(pre, ".pre");
-
-        strncpy(am, src, FILENAME_MAX);
-        am[FILENAME_MAX-1] = '\0';
-        dot = strrchr(am, '.');
-        if (dot) strcpy(dot, ".am"); else strcat(am, ".am");
-
-        /* 1. clean spaces -> .t01 */
-        remove_extra_spaces_file(src, t01);
-        /* 2. remove comma spaces -> .t01a */
-        remove_spaces_next_to_comma_file(t01, t01a);
-        /* 3. strip macros -> .t02 */
-        remove_macro_decls_file(t01a, t02);
-        /* 4. collect macro defs -> .pre */
-        preprocess_file(t02, pre);
-        /* 5. expand macros -> .am */
-        expand_macros(pre, am);
-
-        /* 6. open .am and first pass */
-        fp = fopen(am, "r");
-        if (!fp) {
-            fprintf(stderr, "Error: cannot open %s\n", am);
-            continue;
-        }
-        first_pass(fp, src);
 
-        /* 7. second pass + outputs */
-        rewind(fp);
-        mark_entries(fp);
-        generate_extra_operand_words();
-        create_entry_file(src);
-        write_ext_file(src);
-        create_ob_file(src);
+    if (!parse_options(argc, argv)) {
+        return 1;
+    }
+    if (opt_archive && (opt_disasm || opt_roundtrip || opt_watch || opt_server || opt_link_output ||
+                        opt_build_macro_lib)) {
+        fprintf(stderr, "Error: --archive only applies to assembling sources\n");
+        return 1;
+    }
 
-        print_memory();
-        print_symbol_table();
+    if (opt_macro_lib && !map_macro_library(opt_macro_lib)) {
+        return 1;
+    }
 
-        fclose(fp);
-        /* optionally free tables here before next file */
+    if (opt_server) {
+        return run_server(opt_socket);
     }
-    return 0;
+
+    if (opt_link_output || opt_watch || opt_build_macro_lib) {
+        char *files[MAX_MEMORY];
+        int count = 0;
+        for (file_index = 1; file_index < argc && count < MAX_MEMORY; file_index++) {
+            if (argv[file_index][0] != '-') files[count++] = argv[file_index];
+        }
+        if (opt_watch) {
+            return run_watch(files, count);
+        }
+        if (opt_build_macro_lib) {
+            return build_macro_library(files, count, opt_build_macro_lib) ? 0 : 1;
+        }
+        return link_objects(files, count, opt_link_output) ? 0 : 1;
+    }
+
+    if ((opt_batch_io != BATCH_NONE && !opt_disasm && !opt_roundtrip) || opt_archive) {
+        char **files = malloc(sizeof(char *) * argc);
+        int count = 0, status;
+        if (!files) return 1;
+        for (file_index = 1; file_index < argc; file_index++) {
+            if (argv[file_index][0] != '-' || argv[file_index][1] == '\0') files[count++] = argv[file_index];
+        }
+        status = run_batch(files, count);
+        free(files);
+        return status;
+    }
+
+    for (file_index = 1; file_index < argc; file_index++) {
+        const char *arg = argv[file_index];
+        if (arg[0] == '-' && arg[1] != '\0') continue;   /* option, already handled */
+
+        if (strcmp(arg, "-") == 0) {
+            assemble_stream(stdin, "<stdin>", opt_output, stdout);
+        } else if (opt_disasm) {
+            char dis[FILENAME_MAX];
+            make_filename(dis, arg, ".dis.as");
+            disassemble_file(arg, dis);
+        } else {
+            assemble_file(arg);
+            if (opt_roundtrip) roundtrip_check(arg);
+        }
+    }
+    return total_errors > 0 ? 1 : 0;
 }
+#endif
@@ -0,0 +1,163 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* Reads the object archives written by main --archive=FILE (see archive.h).
+   Usage: obextract [-l | -c] ARCHIVE [MEMBER...]
+     with no MEMBER, every member is extracted to the path it is named by
+     -l  lists the members and their sizes instead
+     -c  writes the members to stdout instead of files
+   A member is found by a binary search of the index and read on its own. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+#define bool int
+#define true 1
+#define false 0
+
+#define MAX_NAME_LENGTH 4096
+
+int archive_fd = -1;
+const char *archive_path;
+ArchiveHeader header;
+
+/* Reads size bytes at offset of the archive; false if the archive is shorter */
+bool read_at(void *buffer, size_t size, unsigned long offset) {
+    size_t done = 0;
+    ssize_t n;
+    while (done < size) {
+        n = pread(archive_fd, (char *)buffer + done, size - done, (off_t)(offset + done));
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+bool open_archive(const char *path) {
+    struct stat info;
+
+    archive_path = path;
+    archive_fd = open(path, O_RDONLY);
+    if (archive_fd < 0 || fstat(archive_fd, &info) != 0) {
+        fprintf(stderr, "Error: cannot open archive %s\n", path);
+        return false;
+    }
+    if (!read_at(&header, sizeof(header), 0) || memcmp(header.magic, ARCHIVE_MAGIC, 4) != 0 ||
+        header.version != ARCHIVE_VERSION || header.byte_order != ARCHIVE_BYTE_ORDER ||
+        header.size != (unsigned long)info.st_size || header.index > header.size ||
+        header.member_count > (header.size - header.index) / sizeof(ArchiveMember)) {
+        fprintf(stderr, "Error: %s is not a version %d object archive for this host\n", path, ARCHIVE_VERSION);
+        return false;
+    }
+    return true;
+}
+
+/* Reads index entry number and its name */
+bool read_member(unsigned int number, ArchiveMember *member, char name[MAX_NAME_LENGTH]) {
+    size_t length;
+
+    if (!read_at(member, sizeof(*member), header.index + (unsigned long)number * sizeof(ArchiveMember)) ||
+        member->offset > header.size || member->size > header.size - member->offset ||
+        member->name >= header.size) {
+        return false;
+    }
+    length = header.size - member->name < MAX_NAME_LENGTH ? header.size - member->name : MAX_NAME_LENGTH;
+    if (!read_at(name, length, member->name) || !memchr(name, '\0', length)) return false;
+    return true;
+}
+
+/* Binary search of the index; false if there is no member called name */
+bool find_member(const char *name, ArchiveMember *member) {
+    char found[MAX_NAME_LENGTH];
+    unsigned int low = 0, high = header.member_count, mid;
+    int order;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (!read_member(mid, member, found)) return false;
+        order = strcmp(name, found);
+        if (order == 0) return true;
+        if (order < 0) high = mid;
+        else low = mid + 1;
+    }
+    return false;
+}
+
+/* Copies the contents of member to out */
+bool copy_member(const ArchiveMember *member, FILE *out) {
+    char buffer[8192];
+    unsigned long done = 0;
+    size_t chunk;
+
+    while (done < member->size) {
+        chunk = member->size - done < sizeof(buffer) ? member->size - done : sizeof(buffer);
+        if (!read_at(buffer, chunk, member->offset + done) || fwrite(buffer, 1, chunk, out) != chunk) return false;
+        done += chunk;
+    }
+    return true;
+}
+
+bool extract_member(const ArchiveMember *member, const char *name, bool to_stdout) {
+    FILE *out;
+    bool ok;
+
+    if (to_stdout) return copy_member(member, stdout);
+    out = fopen(name, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: cannot create %s\n", name);
+        return false;
+    }
+    ok = copy_member(member, out);
+    if (fclose(out) != 0) ok = false;
+    if (!ok) fprintf(stderr, "Error: cannot write %s\n", name);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    ArchiveMember member;
+    char name[MAX_NAME_LENGTH];
+    bool list = false, to_stdout = false;
+    int i = 1, status = 0;
+    unsigned int number;
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "-l") == 0) list = true;
+        else if (strcmp(argv[i], "-c") == 0) to_stdout = true;
+        else break;
+    }
+    if (i >= argc || argv[i][0] == '-' || (list && to_stdout)) {
+        fprintf(stderr, "usage: %s [-l | -c] ARCHIVE [MEMBER...]\n", argv[0]);
+        return 1;
+    }
+    if (!open_archive(argv[i++])) return 1;
+
+    if (i == argc) {
+        /* every member, in index order */
+        for (number = 0; number < header.member_count; number++) {
+            if (!read_member(number, &member, name)) {
+                fprintf(stderr, "Error: %s: member %u is corrupt\n", archive_path, number);
+                status = 1;
+            } else if (list) {
+                printf("%8u %s\n", member.size, name);
+            } else if (!extract_member(&member, name, to_stdout)) {
+                status = 1;
+            }
+        }
+    }
+    for (; i < argc; i++) {
+        if (!find_member(argv[i], &member)) {
+            fprintf(stderr, "Error: %s has no member %s\n", archive_path, argv[i]);
+            status = 1;
+        } else if (list) {
+            printf("%8u %s\n", member.size, argv[i]);
+        } else if (!extract_member(&member, argv[i], to_stdout)) {
+            status = 1;
+        }
+    }
+    close(archive_fd);
+    return status;
+}
@@ -0,0 +1,59 @@
+# Assembles SOURCES in WORK and compares the .ob, .ent and .ext of each with the files of
+# the same name in EXPECTED; an output that has no expected file must be empty or not
+# written. A source with a .err file in EXPECTED must fail with exactly those diagnostics.
+# With LINK, the objects are then linked into LINK.ob and only that is compared.
+#   cmake -DASSEMBLER=main -DSOURCES=a.as|b.as -DEXPECTED=dir -DWORK=dir [-DOPTIONS=x|y]
+#         [-DLINK=name] -P assemble.cmake
+
+string(REPLACE "|" ";" sources "${SOURCES}")
+string(REPLACE "|" ";" options "${OPTIONS}")
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+set(names)
+set(objects)
+foreach(source ${sources})
+    get_filename_component(name ${source} NAME_WE)
+    file(COPY ${source} DESTINATION ${WORK})
+    execute_process(COMMAND ${ASSEMBLER} ${options} ${name}.as
+                    WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status ERROR_VARIABLE errors)
+    if(EXISTS ${EXPECTED}/${name}.err)
+        file(READ ${EXPECTED}/${name}.err expected_errors)
+        if(status EQUAL 0 OR NOT errors STREQUAL expected_errors)
+            message(FATAL_ERROR "${name}.as exited with ${status}, diagnostics differ from "
+                                "${EXPECTED}/${name}.err:\n${errors}")
+        endif()
+    elseif(NOT status EQUAL 0)
+        message(FATAL_ERROR "${ASSEMBLER} ${options} ${name}.as exited with ${status}:\n${errors}")
+    endif()
+    list(APPEND names ${name})
+    list(APPEND objects ${name}.ob)
+endforeach()
+
+if(LINK)
+    execute_process(COMMAND ${ASSEMBLER} --link=${LINK}.ob ${objects}
+                    WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "${ASSEMBLER} --link=${LINK}.ob ${objects} exited with ${status}")
+    endif()
+    set(names ${LINK})
+endif()
+
+foreach(name ${names})
+    foreach(ext ob ent ext)
+        set(output ${WORK}/${name}.${ext})
+        set(expected ${EXPECTED}/${name}.${ext})
+        if(EXISTS ${expected})
+            execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${expected} ${output}
+                            RESULT_VARIABLE differ)
+            if(differ)
+                message(FATAL_ERROR "${name}.${ext} differs from ${expected}")
+            endif()
+        elseif(EXISTS ${output})
+            file(SIZE ${output} size)
+            if(size GREATER 0)
+                message(FATAL_ERROR "${name}.${ext} was written, ${expected} does not exist")
+            endif()
+        endif()
+    endforeach()
+endforeach()
@@ -0,0 +1,41 @@
+# Assembles a generated source with enough statements for the parallel first pass with
+# --jobs=4 and with --jobs=1, and fails unless the .ob, .ent and .ext of the two are the same.
+#   cmake -DASSEMBLER=main -DWORK=dir -P compare_jobs.cmake
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK}/jobs1 ${WORK}/jobs4)
+
+# about 400 statements in under 1000 words: six chunks of the parallel pass
+set(source ".extern EXT\n.entry L0\n.entry D0\n")
+foreach(i RANGE 149)
+    math(EXPR reg "${i} % 8")
+    string(APPEND source "L${i}: mov #${i}, r${reg}\n")
+    math(EXPR every "${i} % 10")
+    if(every EQUAL 0)
+        string(APPEND source ".entry L${i}\njsr EXT\n")
+    endif()
+    if(i LESS 100)
+        math(EXPR previous "${i} / 2")
+        string(APPEND source "D${i}: .data ${i}, -${i}\nprn D${previous}\n")
+    endif()
+endforeach()
+string(APPEND source "stop\n")
+file(WRITE ${WORK}/jobs1/big.as "${source}")
+file(WRITE ${WORK}/jobs4/big.as "${source}")
+
+foreach(jobs 1 4)
+    execute_process(COMMAND ${ASSEMBLER} --jobs=${jobs} big.as
+                    WORKING_DIRECTORY ${WORK}/jobs${jobs} RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "${ASSEMBLER} --jobs=${jobs} big.as exited with ${status}")
+    endif()
+endforeach()
+
+foreach(ext ob ent ext)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/jobs1/big.${ext}
+                            ${WORK}/jobs4/big.${ext}
+                    RESULT_VARIABLE differ)
+    if(differ)
+        message(FATAL_ERROR "big.${ext} differs between --jobs=1 and --jobs=4")
+    endif()
+endforeach()
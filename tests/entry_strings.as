@@ -0,0 +1,7 @@
+; only a real .entry directive marks an entry; % is an operator like the others
+.entry MAIN
+MAIN: mov #7%3, r1
+    prn #10%4
+S: .string ".entry x"
+T: .data 9%5, S
+    stop
@@ -0,0 +1,11 @@
+; errors after macro uses are reported at their source lines
+macro SAVE
+    inc r1
+    inc r2
+    inc r3
+endmacro
+MAIN: SAVE
+mov #1 r3
+    SAVE
+    jmp #1
+    stop
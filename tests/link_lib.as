@@ -0,0 +1,14 @@
+; TAB and END-F: one moves with the data segment, the other stays fixed
+.entry TAB
+.entry F
+.extern G
+F: mov #TAB, r1
+   mov TAB+1, r2
+   lea TAB[r3], r4
+   prn #END-F
+   jsr G
+   rts
+PTR: .data TAB, END-F, 4
+TAB: .data 4, 5, 6
+BUF: .space 4
+END: stop
@@ -0,0 +1,11 @@
+; label expressions in immediates and .data words move with the link
+.entry G
+.extern F
+.extern TAB
+G: mov #Q, r1
+   prn Q+1
+   jsr F
+   mov TAB, r3
+   rts
+Q: .data Q, BUF2, 3
+BUF2: .zero 2
@@ -0,0 +1,9 @@
+; labels that contain the name of the macro used after them
+macro SET r
+    mov #1, r
+endmacro
+SETX: SET r2
+RESET: SET r3
+    jmp SETX
+    jmp RESET
+    stop
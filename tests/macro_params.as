@@ -0,0 +1,15 @@
+; macro parameters may not be mnemonics, registers or directive names
+macro EMIT mov
+    K: .data mov
+endmacro
+macro FILL data
+    .data data
+endmacro
+macro SWAP x, r1
+    mov r1, x
+endmacro
+macro LOAD x
+    mov #1, x
+endmacro
+    LOAD r2
+    stop
@@ -0,0 +1,10 @@
+; -O removes the instructions that L and E are on
+.entry L
+.entry E
+MAIN: mov r1, r2
+L: inc r1
+dec r1
+S: .data 7
+jmp L
+prn S
+E: mov r3, r3
@@ -0,0 +1,13 @@
+; --pool-data: unlabeled .data continues the block before it
+A: .data 1, 2
+T: .data 5, 6
+.data 1, 2
+B: .data 9
+X: .data 8
+U: .data 1, 2
+.data 3
+V: .data 8
+mov T[r1], r2
+mov U[r2], r3
+prn B
+prn V